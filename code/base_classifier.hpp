@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+#include "batch.hpp"
+#include "email.hpp"
+#include "email_view.hpp"
+
+namespace bdap {
+
+// Interface of the classifiers (CRTP): Derived provides update_(email) and
+// predict_(email), which returns a score, for an Email and an EmailView; a
+// score above the threshold classifies the email as spam. update_batch and
+// predict_batch go to update_batch_ and predict_batch_, which Derived may
+// replace; the defaults hash the batch up front, see batch.hpp.
+template <typename Derived>
+class BaseClf {
+    double threshold_;
+
+public:
+    explicit BaseClf(double threshold) : threshold_(threshold) {}
+
+    void update(const Email& email) { static_cast<Derived*>(this)->update_(email); }
+    double predict(const Email& email) const { return static_cast<const Derived*>(this)->predict_(email); }
+
+    void update(const EmailView& email) { static_cast<Derived*>(this)->update_(email); }
+    double predict(const EmailView& email) const { return static_cast<const Derived*>(this)->predict_(email); }
+
+    // the same as update of every email in order, on Emails or EmailViews
+    template <typename E>
+    void update_batch(const E* emails, size_t n) { static_cast<Derived*>(this)->update_batch_(emails, n); }
+
+    template <typename E>
+    void update_batch(const std::vector<E>& emails) { update_batch(emails.data(), emails.size()); }
+
+    // scores[i] = predict(emails[i])
+    template <typename E>
+    void predict_batch(const E* emails, size_t n, double* scores) const {
+        static_cast<const Derived*>(this)->predict_batch_(emails, n, scores);
+    }
+
+    template <typename E>
+    std::vector<double> predict_batch(const std::vector<E>& emails) const {
+        std::vector<double> scores(emails.size());
+        predict_batch(emails.data(), emails.size(), scores.data());
+        return scores;
+    }
+
+    bool classify(double pr) const { return pr > threshold_; }
+    double threshold() const { return threshold_; }
+
+    template <typename E>
+    void update_batch_(const E* emails, size_t n) {
+        hashed_update_batch(*static_cast<Derived*>(this), emails, n);
+    }
+
+    template <typename E>
+    void predict_batch_(const E* emails, size_t n, double* scores) const {
+        hashed_predict_batch(*static_cast<const Derived*>(this), emails, n, scores);
+    }
+};
+
+} // namespace bdap
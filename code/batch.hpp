@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+#include "hashing.hpp"
+
+// Micro-batched training and scoring, behind BaseClf::update_batch and
+// predict_batch: all emails of a batch are hashed up front into per-thread
+// buffers, then applied one after the other, in order, so the results are
+// exactly those of calling update/predict per email; for the perceptrons every
+// update still sees the weights of the previous one. The batch keeps the
+// hashing apart from the table lookups, and lets the ScoringEngine score its
+// queue in one call.
+//
+// The count-min classifiers also prefetch (see
+// NaiveBayesCountMin::set_prefetch_distance): while a block of n-grams is
+// looked up, the num_hashes cells of every n-gram of the next block are
+// loaded, and before an email is applied, those of the first n-grams of the
+// email after it, so the prefetches run ahead across the emails of the batch.
+// benchmark --mode batch measures it against no prefetch.
+namespace bdap {
+
+// per-thread hash buffers for a batch, grown on demand and then reused
+inline std::vector<NgramHashes>& scratch_batch_hashes(size_t n) {
+    thread_local std::vector<NgramHashes> batch;
+    if (batch.size() < n)
+        batch.resize(n);
+    return batch;
+}
+
+// the default BaseClf::update_batch
+template <typename Clf, typename E>
+void hashed_update_batch(Clf& clf, const E* emails, size_t n) {
+    std::vector<NgramHashes>& batch = scratch_batch_hashes(n);
+    for (size_t i = 0; i < n; ++i)
+        clf.hash_email(emails[i], batch[i]);
+    for (size_t i = 0; i < n; ++i)
+        clf.update_hashes(batch[i], emails[i].is_spam());
+}
+
+// the default BaseClf::predict_batch
+template <typename Clf, typename E>
+void hashed_predict_batch(const Clf& clf, const E* emails, size_t n, double* scores) {
+    std::vector<NgramHashes>& batch = scratch_batch_hashes(n);
+    for (size_t i = 0; i < n; ++i)
+        clf.hash_email(emails[i], batch[i]);
+    for (size_t i = 0; i < n; ++i)
+        scores[i] = clf.predict_hashes(batch[i]);
+}
+
+// hashed_update_batch that prefetches the first distance n-grams of the next
+// email, for classifiers with prefetch_ngrams; distance 0 does not prefetch
+template <typename Clf, typename E>
+void prefetched_update_batch(Clf& clf, const E* emails, size_t n, size_t distance) {
+    if (distance == 0) {
+        hashed_update_batch(clf, emails, n);
+        return;
+    }
+    std::vector<NgramHashes>& batch = scratch_batch_hashes(n);
+    for (size_t i = 0; i < n; ++i)
+        clf.hash_email(emails[i], batch[i]);
+    if (n > 0)
+        clf.prefetch_ngrams(batch[0], 0, distance);
+    for (size_t i = 0; i < n; ++i) {
+        if (i + 1 < n)
+            clf.prefetch_ngrams(batch[i + 1], 0, distance);
+        clf.update_hashes(batch[i], emails[i].is_spam());
+    }
+}
+
+// hashed_predict_batch that prefetches like prefetched_update_batch
+template <typename Clf, typename E>
+void prefetched_predict_batch(const Clf& clf, const E* emails, size_t n, double* scores, size_t distance) {
+    if (distance == 0) {
+        hashed_predict_batch(clf, emails, n, scores);
+        return;
+    }
+    std::vector<NgramHashes>& batch = scratch_batch_hashes(n);
+    for (size_t i = 0; i < n; ++i)
+        clf.hash_email(emails[i], batch[i]);
+    if (n > 0)
+        clf.prefetch_ngrams(batch[0], 0, distance);
+    for (size_t i = 0; i < n; ++i) {
+        if (i + 1 < n)
+            clf.prefetch_ngrams(batch[i + 1], 0, distance);
+        scores[i] = clf.predict_hashes(batch[i]);
+    }
+}
+
+} // namespace bdap
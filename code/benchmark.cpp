@@ -0,0 +1,156 @@
+// Benchmark of the four classifiers on synthetic email streams.
+//
+// Build (from the top of the repository, see CMakeLists.txt):
+//
+//   cmake -S . -B build && cmake --build build --target benchmark
+//
+// Run:
+//
+//   ./benchmark [--mode grid|buckets|layout|row-hashing|eval-scaling|train-scaling|
+//                      snapshot|hashing|counters|policies|corpus|
+//                      batch]
+//               [--emails N] [--test-emails N] [--length BYTES] [--vocab WORDS]
+//               [--signal P] [--repeat R] [--drift N] [--seed S] [--ngram 3,4]
+//               [--num-hashes 2,4] [--log-buckets 16,20]
+//               [--classifiers nbfh,nbcm,pfh,pcm,nbcm-rows,pcm-rows,pfh-avg,pcm-avg,ens,
+//                              nbfh-decay,nbcm-decay]
+//               [--dedup 0|1] [--decay-epoch E] [--decay F]
+//               [--threads 1,2,4]
+//               [--table-memory default,transparent,explicit,interleave,transparent+local]
+//               [--out results.json]
+//
+// Every classifier is trained on the same stream and scored on the same test
+// stream for every point of the ngram x num_hashes x log_num_buckets grid
+// (num_hashes only applies to the Count-Min classifiers; nbcm-rows and pcm-rows
+// are the same classifiers specialized on num_hashes, see dispatch.hpp; pfh-avg
+// and pcm-avg are the perceptrons in averaged mode, see set_averaged; ens is an
+// Ensemble of nbfh, nbcm, pfh and pcm voting with equal weights, so its cost
+// can be held against the sum of theirs; nbfh-decay and nbcm-decay are the
+// naive bayes classifiers forgetting by --decay every --decay-epoch emails, see
+// set_decay, and only run when asked for). Per point it reports
+// update and predict throughput, p50/p99 per-email latency, model memory, table
+// occupancy (see TableStats) and F1 on the test stream, as JSON on stdout or
+// in --out.
+//
+// --table-memory repeats the grid for every listed placement of the tables, a
+// page size and/or a NUMA placement joined by '+' (see TableMemory). Per point
+// it also reports the data TLB misses per predicted email, from the perf
+// counters where perf_event_open is allowed (null elsewhere), and the
+// process's AnonHugePages after training, which shows whether huge pages were
+// actually granted. The TLB only becomes the bottleneck from --log-buckets 22
+// or so.
+//
+// The other --mode's measure one thing each, with their own defaults for the
+// options not given:
+//
+//   buckets  the grid over --log-buckets 10,12,..,24 for nbfh and nbcm: predict
+//            latency stays flat as the tables grow, because the class totals
+//            are kept up to date in update (see total_spam_ of NaiveBayesCountMin)
+//   layout   n-grams/sec of Count-Min updates and queries with the spam and ham
+//            counts of a bucket next to each other (CountMinSketch) against
+//            a vector per row and per class, for every --num-hashes and
+//            --log-buckets (16,20,22)
+//   row-hashing  n-grams/sec of the nbcm and pcm lookups of the test stream
+//            with a hash per Count-Min row against one hash and RowHasher,
+//            for --num-hashes 2,4,7
+//   eval-scaling  emails/sec of ConfusionMatrix::evaluate_parallel over the
+//            test stream for nbfh, nbcm, pfh and pcm on every number of
+//            --threads (1,2,4,.. up to the number of cores), its speedup over
+//            evaluate and whether it counted the same
+//   train-scaling  the same for train_sharded of nbfh and nbcm, merging at the
+//            end and every 1000 emails, against training serially, and
+//            whether the sharded model scores the test stream the same
+//   snapshot  emails/sec scored by --threads readers through SnapshotClf of
+//            nbfh and pfh, without a writer and with one training and
+//            publishing every 1 or 100 updates meanwhile
+//   hashing  emails/sec of predict-then-update over the training stream for
+//            nbfh, nbcm, pfh and pcm, hashing every email twice (predict and
+//            update), once into the reused per-thread buffer and once into a
+//            new buffer per email; see also tests/alloc_test.cpp
+//   counters  the grid over --log-buckets 14,16,18,20 for nbfh and nbcm with
+//            every cell type of counters.hpp, named like nbcm-u8, so that F1
+//            can be held against memory_bytes and throughput
+//   policies  nbcm over --num-hashes 2,4,8 and --log-buckets 14,16,18 under
+//            every sketch update and query policy, named like
+//            nbcm-conservative-min
+//   corpus  writes the training stream to a temporary corpus file and trains
+//            nbfh, nbcm, pfh and pcm on it twice: loading it into memory
+//            first, and streaming it through CorpusReader; reports the bytes
+//            the loaded emails hold and whether both models score the same
+//   batch  emails/sec of update_batch and predict_batch for nbfh, nbcm, pfh
+//            and pcm per batch size (1,4,..,256), against update and predict
+//            per email (batch 0); nbcm and pcm also per prefetch distance
+//            (0 = no prefetch, 16, 64, 128 n-grams)
+//
+// The emails are generated, not loaded: words are drawn from a Zipf
+// distribution over a random vocabulary, and with probability --signal from a
+// second Zipf distribution that differs between spam and ham, so the stream
+// is learnable but not trivially. With --repeat R every email is one block
+// of words repeated R times, like boilerplate in spam; --dedup 1 then has the
+// classifiers collapse the repeats (see NgramHashes). With --drift N the class
+// words move to other ranks every N training emails, like a new spam campaign,
+// and the test stream is drawn from the last campaign, so a model that does not
+// forget scores worse. The same --seed gives the same streams.
+// The emails are EmailViews over one buffer and go through hash_email, so the
+// benchmark does not depend on how Email is constructed.
+// main parses the options and runs the mode; the modes live in benchmark/,
+// declared in benchmark/benchmark.hpp.
+
+#include <exception>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "benchmark/benchmark.hpp"
+#include "synthetic_stream.hpp"
+
+using namespace bdap;
+using namespace bdap::bench;
+
+int main(int argc, char** argv) {
+    Options o;
+    try {
+        o = parse_options(argc, argv);
+        set_mode_defaults(o);
+    } catch (const std::exception& e) {
+        std::cerr << "benchmark: " << e.what() << "\n";
+        return 2;
+    }
+
+    std::mt19937_64 rng(o.seed);
+    StreamGenerator generator(o.vocab, o.signal, rng);
+    Stream train = generator.generate(o.emails, o.length, o.repeat, o.drift, 0, rng);
+    size_t last_campaign = o.drift != 0 && o.emails != 0 ? (o.emails - 1) / o.drift : 0;
+    Stream test = generator.generate(o.test_emails, o.length, o.repeat, 0, last_campaign, rng);
+
+    std::vector<Settings> settings_list;
+    try {
+        for (const std::string& name : o.table_memory)
+            settings_list.push_back(Settings{o.dedup, name, parse_table_memory(name)});
+    } catch (const std::exception& e) {
+        std::cerr << "benchmark: " << e.what() << "\n";
+        return 2;
+    }
+
+    if (o.mode == "policies")
+        return write_results(o, run_policies(o, settings_list, train, test));
+    if (o.mode == "counters")
+        return write_results(o, run_counters(o, settings_list, train, test));
+    if (o.mode == "layout")
+        return write_results(o, run_layouts(o, train, test));
+    if (o.mode == "eval-scaling")
+        return write_results(o, run_eval_scaling(o, train, test));
+    if (o.mode == "train-scaling")
+        return write_results(o, run_train_scaling(o, train, test));
+    if (o.mode == "snapshot")
+        return write_results(o, run_snapshot(o, train, test));
+    if (o.mode == "hashing")
+        return write_results(o, run_hashing(o, train));
+    if (o.mode == "batch")
+        return write_results(o, run_batch(o, train, test));
+    if (o.mode == "corpus")
+        return write_results(o, run_corpus(o, train, test));
+    if (o.mode == "row-hashing")
+        return write_results(o, run_row_hashing(o, test));
+    return write_results(o, run_grid(o, settings_list, train, test));
+}
@@ -0,0 +1,68 @@
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "benchmark/benchmark.hpp"
+
+namespace bdap {
+namespace bench {
+
+namespace {
+
+// set_prefetch_distance of the count-min classifiers; false for the others,
+// which do not prefetch
+template <typename Clf>
+auto set_prefetch(Clf& clf, size_t distance, int) -> decltype(clf.set_prefetch_distance(distance), bool()) {
+    clf.set_prefetch_distance(distance);
+    return true;
+}
+
+template <typename Clf>
+bool set_prefetch(Clf&, size_t distance, long) { return distance == 0; }
+
+} // namespace
+
+// emails/sec of update_batch over the training stream and predict_batch over
+// the test stream (see batch.hpp) per batch size, against update and predict
+// per email (batch size 0), and per prefetch distance where it applies
+std::vector<Row> run_batch(const Options& o, const Stream& train, const Stream& test) {
+    std::vector<Email> updates = to_emails(train);
+    std::vector<Email> emails = to_emails(test);
+    std::vector<double> scores(emails.size());
+    std::vector<Row> rows;
+    for_each_classifier(o, [&](const std::string& name, const auto& empty, int ngram, int k, int lb) {
+        for (size_t distance : {size_t{0}, size_t{16}, size_t{64}, size_t{128}})
+        for (size_t batch : {size_t{0}, size_t{1}, size_t{4}, size_t{16}, size_t{64}, size_t{256}}) {
+            auto clf = empty;
+            if (!set_prefetch(clf, distance, 0))
+                continue;
+            double update_s = seconds([&] {
+                if (batch == 0) {
+                    for (const Email& email : updates)
+                        clf.update(email);
+                    return;
+                }
+                for (size_t i = 0; i < updates.size(); i += batch)
+                    clf.update_batch(updates.data() + i, std::min(batch, updates.size() - i));
+            });
+            double predict_s = seconds([&] {
+                if (batch == 0) {
+                    for (size_t i = 0; i < emails.size(); ++i)
+                        scores[i] = clf.predict(emails[i]);
+                    return;
+                }
+                for (size_t i = 0; i < emails.size(); i += batch)
+                    clf.predict_batch(emails.data() + i, std::min(batch, emails.size() - i), scores.data() + i);
+            });
+            keep(static_cast<long long>(std::count_if(scores.begin(), scores.end(),
+                                                      [&](double s) { return clf.classify(s); })));
+            rows.push_back(Row().add("classifier", name).add("ngram", ngram).add("num_hashes", k)
+                               .add("log_num_buckets", lb).add("batch", batch).add("prefetch_distance", distance)
+                               .add("update_emails_per_sec", updates.size() / update_s)
+                               .add("predict_emails_per_sec", emails.size() / predict_s));
+        }
+    });
+    return rows;
+}
+
+} // namespace bench
+} // namespace bdap
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+#include "email.hpp"
+#include "instrumentation.hpp"
+#include "naive_bayes_count_min.hpp"
+#include "naive_bayes_feature_hashing.hpp"
+#include "perceptron_count_min.hpp"
+#include "perceptron_feature_hashing.hpp"
+#include "synthetic_stream.hpp"
+#include "table_memory.hpp"
+
+// What the modes of the benchmark (see benchmark.cpp) share: the options, the
+// results and their JSON output, and the helpers that time a loop and keep
+// its result. Every mode is in a file of its own next to this one.
+namespace bdap {
+namespace bench {
+
+struct Options {
+    std::string mode = "grid";
+    size_t emails = 20000;
+    size_t test_emails = 5000;
+    size_t length = 1000; // bytes per email
+    size_t vocab = 50000; // distinct words
+    double signal = 0.05; // fraction of words that depend on the class
+    size_t repeat = 1;    // times the words of an email are repeated
+    size_t drift = 0;     // training emails per campaign, 0 = no drift
+    unsigned seed = 1;
+    std::vector<int> ngram = {3, 4};
+    std::vector<int> num_hashes = {2, 4};
+    std::vector<int> log_buckets = {16, 20};
+    std::vector<std::string> classifiers = {"nbfh", "nbcm", "pfh", "pcm", "nbcm-rows", "pcm-rows",
+                                            "pfh-avg", "pcm-avg", "ens"};
+    bool dedup = false;
+    size_t decay_epoch = 1000; // of nbfh-decay and nbcm-decay
+    double decay = 0.5;
+    std::vector<std::string> table_memory = {"default"};
+    std::vector<int> threads; // of the scaling modes
+    std::string out;
+    std::set<std::string> given; // options on the command line, for the defaults of the modes
+};
+
+struct Timing {
+    double emails_per_sec = 0.0;
+    double p50_ns = 0.0;
+    double p99_ns = 0.0;
+};
+
+// what every classifier of a grid point is set up with
+struct Settings {
+    bool dedup;
+    std::string table_memory_name;
+    TableMemory table_memory;
+};
+
+struct Result {
+    std::string classifier;
+    int ngram;
+    int num_hashes; // 0 for the feature hashing classifiers
+    int log_num_buckets;
+    size_t memory_bytes;
+    TableStats table;
+    Timing update;
+    Timing predict;
+    double f1;
+    std::string table_memory;
+    double dtlb_misses_per_email; // of predict, nan if not counted
+    double anon_huge_pages_kb;
+};
+
+Options parse_options(int argc, char** argv);
+
+// the defaults of the other modes, for the options not on the command line
+void set_mode_defaults(Options& o);
+
+// "transparent+interleave" and the like, see --table-memory
+TableMemory parse_table_memory(const std::string& s);
+
+// whether name is in --classifiers
+bool wanted(const Options& o, const std::string& name);
+
+// JSON numbers cannot be nan or inf
+std::string json_number(double x);
+
+// one result of the modes that do not run the classifier grid, a flat JSON object
+class Row {
+    std::vector<std::pair<std::string, std::string>> fields_; // name, JSON value
+
+public:
+    Row& add(const std::string& name, double x) {
+        fields_.emplace_back(name, json_number(x));
+        return *this;
+    }
+    Row& add(const std::string& name, const std::string& s) {
+        fields_.emplace_back(name, "\"" + s + "\"");
+        return *this;
+    }
+    Row& add_bool(const std::string& name, bool b) {
+        fields_.emplace_back(name, b ? "true" : "false");
+        return *this;
+    }
+
+    void write(std::ostream& out) const {
+        out << "{";
+        for (size_t i = 0; i < fields_.size(); ++i)
+            out << (i ? ", " : "") << "\"" << fields_[i].first << "\": " << fields_[i].second;
+        out << "}";
+    }
+};
+
+void write_json(std::ostream& out, const Options& o, const std::vector<Result>& results);
+void write_json(std::ostream& out, const Options& o, const std::vector<Row>& rows);
+
+template <typename Results>
+int write_results(const Options& o, const Results& results) {
+    if (o.out.empty()) {
+        write_json(std::cout, o, results);
+        return 0;
+    }
+    std::ofstream out(o.out);
+    write_json(out, o, results);
+    if (!out) {
+        std::cerr << "benchmark: cannot write " << o.out << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+template <typename F>
+double seconds(F f) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// keeps a result alive so that the loop computing it is not optimized away
+inline void keep(long long x) { asm volatile("" : : "g"(x) : "memory"); }
+
+// calls fn(name, clf, ngram, num_hashes, log_buckets) for nbfh, nbcm, pfh and
+// pcm, where in --classifiers, at every point of the grid
+template <typename Fn>
+void for_each_classifier(const Options& o, Fn fn) {
+    for (int ngram : o.ngram) {
+        for (int lb : o.log_buckets) {
+            if (wanted(o, "nbfh"))
+                fn("nbfh", NaiveBayesFeatureHashing(ngram, lb), ngram, 0, lb);
+            if (wanted(o, "pfh"))
+                fn("pfh", PerceptronFeatureHashing(ngram, lb, 0.01), ngram, 0, lb);
+            for (int k : o.num_hashes) {
+                if (wanted(o, "nbcm"))
+                    fn("nbcm", NaiveBayesCountMin(ngram, k, lb), ngram, k, lb);
+                if (wanted(o, "pcm"))
+                    fn("pcm", PerceptronCountMin(ngram, k, lb, 0.01), ngram, k, lb);
+            }
+        }
+    }
+}
+
+// for the APIs that take std::vector<Email>
+std::vector<Email> to_emails(const Stream& stream);
+
+// the modes: grid.cpp
+std::vector<Result> run_grid(const Options& o, const std::vector<Settings>& settings_list,
+                             const Stream& train, const Stream& test);
+std::vector<Result> run_counters(const Options& o, const std::vector<Settings>& settings_list,
+                                 const Stream& train, const Stream& test);
+std::vector<Result> run_policies(const Options& o, const std::vector<Settings>& settings_list,
+                                 const Stream& train, const Stream& test);
+// layout.cpp
+std::vector<Row> run_layouts(const Options& o, const Stream& train, const Stream& test);
+std::vector<Row> run_row_hashing(const Options& o, const Stream& test);
+// scaling.cpp
+std::vector<Row> run_eval_scaling(const Options& o, const Stream& train, const Stream& test);
+std::vector<Row> run_train_scaling(const Options& o, const Stream& train, const Stream& test);
+std::vector<Row> run_snapshot(const Options& o, const Stream& train, const Stream& test);
+// batch.cpp, hashing.cpp, corpus.cpp
+std::vector<Row> run_batch(const Options& o, const Stream& train, const Stream& test);
+std::vector<Row> run_hashing(const Options& o, const Stream& train);
+std::vector<Row> run_corpus(const Options& o, const Stream& train, const Stream& test);
+
+} // namespace bench
+} // namespace bdap
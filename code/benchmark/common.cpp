@@ -0,0 +1,218 @@
+#include <algorithm>
+#include <cmath>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "benchmark/benchmark.hpp"
+#include "parallel.hpp"
+
+namespace bdap {
+namespace bench {
+
+namespace {
+
+std::vector<int> parse_ints(const std::string& s) {
+    std::vector<int> v;
+    std::stringstream in(s);
+    std::string item;
+    while (std::getline(in, item, ','))
+        v.push_back(std::stoi(item));
+    return v;
+}
+
+std::vector<std::string> parse_names(const std::string& s) {
+    std::vector<std::string> v;
+    std::stringstream in(s);
+    std::string item;
+    while (std::getline(in, item, ','))
+        v.push_back(item);
+    return v;
+}
+
+void write_timing(std::ostream& out, const Timing& t) {
+    out << "{\"emails_per_sec\": " << json_number(t.emails_per_sec)
+        << ", \"p50_ns\": " << json_number(t.p50_ns)
+        << ", \"p99_ns\": " << json_number(t.p99_ns) << "}";
+}
+
+void write_config(std::ostream& out, const Options& o) {
+    out << "{\n  \"config\": {\"mode\": \"" << o.mode << "\", \"emails\": " << o.emails << ", \"test_emails\": " << o.test_emails
+        << ", \"length\": " << o.length << ", \"vocab\": " << o.vocab
+        << ", \"signal\": " << json_number(o.signal) << ", \"repeat\": " << o.repeat
+        << ", \"drift\": " << o.drift << ", \"dedup\": " << (o.dedup ? "true" : "false")
+        << ", \"decay_epoch\": " << o.decay_epoch << ", \"decay\": " << json_number(o.decay)
+        << ", \"seed\": " << o.seed << ", \"huge_page_bytes\": " << detail::huge_page_bytes() << "},\n";
+}
+
+} // namespace
+
+Options parse_options(int argc, char** argv) {
+    Options o;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc)
+            throw std::invalid_argument("missing value for " + arg);
+        std::string value = argv[++i];
+        o.given.insert(arg);
+        if (arg == "--mode") o.mode = value;
+        else if (arg == "--emails") o.emails = std::stoul(value);
+        else if (arg == "--test-emails") o.test_emails = std::stoul(value);
+        else if (arg == "--length") o.length = std::stoul(value);
+        else if (arg == "--vocab") o.vocab = std::stoul(value);
+        else if (arg == "--signal") o.signal = std::stod(value);
+        else if (arg == "--repeat") o.repeat = std::stoul(value);
+        else if (arg == "--drift") o.drift = std::stoul(value);
+        else if (arg == "--dedup") o.dedup = std::stoi(value) != 0;
+        else if (arg == "--decay-epoch") o.decay_epoch = std::stoul(value);
+        else if (arg == "--decay") o.decay = std::stod(value);
+        else if (arg == "--table-memory") o.table_memory = parse_names(value);
+        else if (arg == "--seed") o.seed = static_cast<unsigned>(std::stoul(value));
+        else if (arg == "--ngram") o.ngram = parse_ints(value);
+        else if (arg == "--num-hashes") o.num_hashes = parse_ints(value);
+        else if (arg == "--log-buckets") o.log_buckets = parse_ints(value);
+        else if (arg == "--classifiers") o.classifiers = parse_names(value);
+        else if (arg == "--threads") o.threads = parse_ints(value);
+        else if (arg == "--out") o.out = value;
+        else throw std::invalid_argument("unknown option " + arg);
+    }
+    return o;
+}
+
+void set_mode_defaults(Options& o) {
+    auto unless_given = [&o](const char* arg, auto& option, auto value) {
+        if (o.given.count(arg) == 0)
+            option = value;
+    };
+    if (o.mode == "grid") {
+    } else if (o.mode == "buckets") {
+        unless_given("--classifiers", o.classifiers, std::vector<std::string>{"nbfh", "nbcm"});
+        unless_given("--ngram", o.ngram, std::vector<int>{3});
+        unless_given("--num-hashes", o.num_hashes, std::vector<int>{2});
+        unless_given("--log-buckets", o.log_buckets, std::vector<int>{10, 12, 14, 16, 18, 20, 22, 24});
+    } else if (o.mode == "counters") {
+        unless_given("--classifiers", o.classifiers, std::vector<std::string>{"nbfh", "nbcm"});
+        unless_given("--ngram", o.ngram, std::vector<int>{3});
+        unless_given("--num-hashes", o.num_hashes, std::vector<int>{4});
+        unless_given("--log-buckets", o.log_buckets, std::vector<int>{14, 16, 18, 20});
+    } else if (o.mode == "policies") {
+        unless_given("--classifiers", o.classifiers, std::vector<std::string>{"nbcm"});
+        unless_given("--ngram", o.ngram, std::vector<int>{3});
+        unless_given("--num-hashes", o.num_hashes, std::vector<int>{2, 4, 8});
+        unless_given("--log-buckets", o.log_buckets, std::vector<int>{14, 16, 18});
+    } else if (o.mode == "layout") {
+        unless_given("--emails", o.emails, size_t{5000});
+        unless_given("--ngram", o.ngram, std::vector<int>{3});
+        unless_given("--log-buckets", o.log_buckets, std::vector<int>{16, 20, 22});
+    } else if (o.mode == "eval-scaling") {
+        unless_given("--classifiers", o.classifiers, std::vector<std::string>{"nbfh", "nbcm", "pfh", "pcm"});
+        unless_given("--ngram", o.ngram, std::vector<int>{3});
+        unless_given("--num-hashes", o.num_hashes, std::vector<int>{4});
+        unless_given("--log-buckets", o.log_buckets, std::vector<int>{20});
+    } else if (o.mode == "train-scaling") {
+        unless_given("--classifiers", o.classifiers, std::vector<std::string>{"nbfh", "nbcm"});
+        unless_given("--ngram", o.ngram, std::vector<int>{3});
+        unless_given("--num-hashes", o.num_hashes, std::vector<int>{4});
+        unless_given("--log-buckets", o.log_buckets, std::vector<int>{20});
+    } else if (o.mode == "snapshot") {
+        unless_given("--classifiers", o.classifiers, std::vector<std::string>{"nbfh", "pfh"});
+        unless_given("--ngram", o.ngram, std::vector<int>{3});
+        unless_given("--log-buckets", o.log_buckets, std::vector<int>{20});
+    } else if (o.mode == "batch" || o.mode == "corpus") {
+        unless_given("--classifiers", o.classifiers, std::vector<std::string>{"nbfh", "nbcm", "pfh", "pcm"});
+        unless_given("--ngram", o.ngram, std::vector<int>{3});
+        unless_given("--num-hashes", o.num_hashes, std::vector<int>{4});
+        unless_given("--log-buckets", o.log_buckets, std::vector<int>{20});
+    } else if (o.mode == "hashing") {
+        unless_given("--classifiers", o.classifiers, std::vector<std::string>{"nbfh", "nbcm", "pfh", "pcm"});
+        unless_given("--ngram", o.ngram, std::vector<int>{3});
+        unless_given("--num-hashes", o.num_hashes, std::vector<int>{4});
+        unless_given("--log-buckets", o.log_buckets, std::vector<int>{20});
+    } else if (o.mode == "row-hashing") {
+        unless_given("--ngram", o.ngram, std::vector<int>{3});
+        unless_given("--num-hashes", o.num_hashes, std::vector<int>{2, 4, 7});
+        unless_given("--log-buckets", o.log_buckets, std::vector<int>{20});
+    } else {
+        throw std::invalid_argument("unknown mode " + o.mode);
+    }
+    // 1, 2, 4, .. and all cores
+    if (o.threads.empty()) {
+        int cores = default_num_threads();
+        for (int t = 1; t < cores; t *= 2)
+            o.threads.push_back(t);
+        o.threads.push_back(cores);
+    }
+}
+
+TableMemory parse_table_memory(const std::string& s) {
+    TableMemory m;
+    std::stringstream in(s);
+    std::string item;
+    while (std::getline(in, item, '+')) {
+        if (item == "default") {}
+        else if (item == "transparent") m.pages = TablePages::Transparent;
+        else if (item == "explicit") m.pages = TablePages::Explicit;
+        else if (item == "local") m.numa = TableNuma::Local;
+        else if (item == "interleave") m.numa = TableNuma::Interleave;
+        else throw std::invalid_argument("unknown table memory " + item);
+    }
+    return m;
+}
+
+bool wanted(const Options& o, const std::string& name) {
+    return std::find(o.classifiers.begin(), o.classifiers.end(), name) != o.classifiers.end();
+}
+
+std::string json_number(double x) {
+    if (!std::isfinite(x))
+        return "null";
+    std::ostringstream out;
+    out.precision(6);
+    out << x;
+    return out.str();
+}
+
+void write_json(std::ostream& out, const Options& o, const std::vector<Result>& results) {
+    write_config(out, o);
+    out << "  \"results\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        out << (i ? ",\n" : "\n") << "    {\"classifier\": \"" << r.classifier << "\""
+            << ", \"ngram\": " << r.ngram << ", \"num_hashes\": " << r.num_hashes
+            << ", \"log_num_buckets\": " << r.log_num_buckets
+            << ", \"memory_bytes\": " << r.memory_bytes
+            << ", \"load_factor\": " << json_number(r.table.load_factor)
+            << ", \"collision_rate\": " << json_number(r.table.collision_rate)
+            << ", \"undersized\": " << (r.table.undersized() ? "true" : "false") << ", \"update\": ";
+        write_timing(out, r.update);
+        out << ", \"predict\": ";
+        write_timing(out, r.predict);
+        out << ", \"f1\": " << json_number(r.f1)
+            << ", \"table_memory\": \"" << r.table_memory << "\""
+            << ", \"dtlb_misses_per_email\": " << json_number(r.dtlb_misses_per_email)
+            << ", \"anon_huge_pages_kb\": " << json_number(r.anon_huge_pages_kb) << "}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+void write_json(std::ostream& out, const Options& o, const std::vector<Row>& rows) {
+    write_config(out, o);
+    out << "  \"results\": [";
+    for (size_t i = 0; i < rows.size(); ++i) {
+        out << (i ? ",\n    " : "\n    ");
+        rows[i].write(out);
+    }
+    out << "\n  ]\n}\n";
+}
+
+std::vector<Email> to_emails(const Stream& stream) {
+    std::vector<Email> emails;
+    emails.reserve(stream.emails.size());
+    for (const EmailView& email : stream.emails)
+        emails.emplace_back(email.is_spam(), std::string(email.body()));
+    return emails;
+}
+
+} // namespace bench
+} // namespace bdap
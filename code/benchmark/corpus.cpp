@@ -0,0 +1,98 @@
+#include <cstdlib>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "benchmark/benchmark.hpp"
+#include "corpus.hpp"
+
+namespace bdap {
+namespace bench {
+
+namespace {
+
+// the emails of a corpus file (see corpus.hpp) read into memory, the way a
+// corpus was loaded before CorpusReader
+std::vector<Email> load_corpus(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+        throw std::runtime_error("cannot open file: " + path);
+    std::vector<Email> emails;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (line.size() < 2 || (line[0] != '0' && line[0] != '1'))
+            continue;
+        emails.emplace_back(line[0] == '1', line.substr(2));
+    }
+    return emails;
+}
+
+} // namespace
+
+// Trains on the training stream written to a temporary corpus file, once by
+// loading the file into a vector of Email and training on that (load), once
+// by streaming it through CorpusReader (stream). An empty file goes along in
+// the reader's list, which it has to skip.
+std::vector<Row> run_corpus(const Options& o, const Stream& train, const Stream& test) {
+    const char* tmp = std::getenv("TMPDIR");
+    std::string dir = tmp != nullptr && *tmp != '\0' ? tmp : "/tmp";
+    std::string path = dir + "/bdap-corpus-XXXXXX";
+    std::string empty_path = path;
+    int fd = ::mkstemp(path.data());
+    int empty_fd = fd < 0 ? -1 : ::mkstemp(empty_path.data());
+    if (fd < 0 || empty_fd < 0)
+        throw std::runtime_error("cannot create a temporary file in " + dir);
+    ::close(fd);
+    ::close(empty_fd);
+    size_t file_bytes = 0;
+    {
+        std::ofstream out(path, std::ios::binary);
+        for (const EmailView& email : train.emails) {
+            out << (email.is_spam() ? '1' : '0') << ',' << email.body() << '\n';
+            file_bytes += email.body().size() + 3;
+        }
+    }
+    std::vector<Email> probes = to_emails(test);
+
+    std::vector<Row> rows;
+    for_each_classifier(o, [&](const std::string& name, const auto& empty, int ngram, int k, int lb) {
+        auto loaded = empty;
+        size_t held_bytes = 0;
+        double load_s = 0.0;
+        double load_train_s = seconds([&] {
+            std::vector<Email> emails;
+            load_s = seconds([&] { emails = load_corpus(path); });
+            for (const Email& email : emails) {
+                held_bytes += sizeof(Email) + email.body().size();
+                loaded.update(email);
+            }
+        });
+
+        auto streamed = empty;
+        long long n = 0;
+        double stream_s = seconds([&] {
+            CorpusReader reader(std::vector<std::string>{empty_path, path, empty_path});
+            n = train_corpus(streamed, reader);
+        });
+
+        // both ways must give the same model
+        bool same = n == static_cast<long long>(train.emails.size());
+        for (size_t i = 0; i < probes.size() && same; ++i)
+            same = loaded.predict(probes[i]) == streamed.predict(probes[i]);
+
+        rows.push_back(Row().add("classifier", name).add("ngram", ngram).add("num_hashes", k)
+                           .add("log_num_buckets", lb).add("file_bytes", file_bytes)
+                           .add("load_sec", load_s).add("held_bytes", held_bytes)
+                           .add("load_train_emails_per_sec", n / load_train_s)
+                           .add("stream_emails_per_sec", n / stream_s).add_bool("same_model", same));
+    });
+    ::unlink(path.c_str());
+    ::unlink(empty_path.c_str());
+    return rows;
+}
+
+} // namespace bench
+} // namespace bdap
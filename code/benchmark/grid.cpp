@@ -0,0 +1,277 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include "benchmark/benchmark.hpp"
+#include "counters.hpp"
+#include "dispatch.hpp"
+#include "ensemble.hpp"
+#include "metrics.hpp"
+
+namespace bdap {
+namespace bench {
+
+namespace {
+
+// latency percentiles of the per-email times and the overall throughput
+Timing summarize(std::vector<double>& ns, double seconds) {
+    Timing t;
+    if (ns.empty())
+        return t;
+    std::sort(ns.begin(), ns.end());
+    t.emails_per_sec = seconds > 0 ? ns.size() / seconds : 0.0;
+    t.p50_ns = ns[ns.size() / 2];
+    t.p99_ns = ns[std::min(ns.size() - 1, ns.size() * 99 / 100)];
+    return t;
+}
+
+// Data TLB read misses of the calling thread in user space, from the perf
+// counters; valid() is false where perf_event_open is not allowed (see
+// /proc/sys/kernel/perf_event_paranoid) or not supported.
+class TlbMissCounter {
+    int fd_ = -1;
+
+public:
+    TlbMissCounter() {
+#if defined(__linux__) && defined(SYS_perf_event_open)
+        perf_event_attr attr{};
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                      | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd_ = static_cast<int>(::syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+    }
+
+    ~TlbMissCounter() {
+        if (fd_ >= 0)
+            ::close(fd_);
+    }
+
+    TlbMissCounter(const TlbMissCounter&) = delete;
+    TlbMissCounter& operator=(const TlbMissCounter&) = delete;
+
+    bool valid() const { return fd_ >= 0; }
+
+    void start() {
+#if defined(__linux__) && defined(SYS_perf_event_open)
+        if (fd_ >= 0) {
+            ::ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+            ::ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    // misses since start, -1 if not counted
+    double stop() {
+#if defined(__linux__) && defined(SYS_perf_event_open)
+        if (fd_ >= 0) {
+            ::ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+            long long count = 0;
+            if (::read(fd_, &count, sizeof(count)) == sizeof(count))
+                return static_cast<double>(count);
+        }
+#endif
+        return -1.0;
+    }
+};
+
+// AnonHugePages of the whole process in kB, -1 where /proc does not tell
+double anon_huge_pages_kb() {
+    std::ifstream in("/proc/self/smaps_rollup");
+    std::string line;
+    while (std::getline(in, line))
+        if (line.compare(0, 14, "AnonHugePages:") == 0)
+            return std::stod(line.substr(14));
+    return -1.0;
+}
+
+// a perceptron in averaged mode
+template <typename Clf>
+Clf averaged(Clf clf) {
+    clf.set_averaged(true);
+    return clf;
+}
+
+// a naive bayes classifier with decay
+template <typename Clf>
+Clf decayed(Clf clf, size_t epoch, double factor) {
+    clf.set_decay(epoch, factor);
+    return clf;
+}
+
+template <typename Clf>
+Result run(const std::string& name, Clf clf, int ngram, int num_hashes, int log_buckets,
+           const Stream& train, const Stream& test, const Settings& settings)
+{
+    clf.set_dedup(settings.dedup);
+    clf.set_table_memory(settings.table_memory);
+    using clock = std::chrono::steady_clock;
+    std::vector<double> ns;
+    ns.reserve(std::max(train.emails.size(), test.emails.size()));
+
+    clock::time_point start = clock::now();
+    for (const EmailView& email : train.emails) {
+        clock::time_point t0 = clock::now();
+        clf.update(email);
+        ns.push_back(std::chrono::duration<double, std::nano>(clock::now() - t0).count());
+    }
+    Timing update = summarize(ns, std::chrono::duration<double>(clock::now() - start).count());
+    double huge_kb = anon_huge_pages_kb();
+
+    ns.clear();
+    F1Score f1;
+    TlbMissCounter tlb;
+    tlb.start();
+    start = clock::now();
+    for (const EmailView& email : test.emails) {
+        clock::time_point t0 = clock::now();
+        double score = clf.predict(email);
+        ns.push_back(std::chrono::duration<double, std::nano>(clock::now() - t0).count());
+        f1.add(email.is_spam(), clf.classify(score));
+    }
+    Timing predict = summarize(ns, std::chrono::duration<double>(clock::now() - start).count());
+    double misses = tlb.stop();
+    double misses_per_email = misses >= 0 && !test.emails.empty() ? misses / test.emails.size() : NAN;
+
+    return Result{name, ngram, num_hashes, log_buckets, clf.memory_bytes(), clf.table_stats(), update, predict,
+                  f1.get_score(), settings.table_memory_name, misses_per_email, huge_kb};
+}
+
+// calls fn(name, cell) with a value of every cell type of counters.hpp
+template <typename Fn>
+void for_each_cell_type(Fn fn) {
+    fn("int", int{});
+    fn("float", float{});
+    fn("u16", SaturatingCounter<uint16_t>{});
+    fn("u8", SaturatingCounter<uint8_t>{});
+    fn("morris", MorrisCounter{});
+}
+
+} // namespace
+
+// the classifiers of --classifiers at every point of the grid
+std::vector<Result> run_grid(const Options& o, const std::vector<Settings>& settings_list,
+                             const Stream& train, const Stream& test)
+{
+    std::vector<Result> results;
+    for (const Settings& settings : settings_list) {
+        for (int ngram : o.ngram) {
+            for (int lb : o.log_buckets) {
+                if (wanted(o, "nbfh"))
+                    results.push_back(run("nbfh", NaiveBayesFeatureHashing(ngram, lb),
+                                          ngram, 0, lb, train, test, settings));
+                if (wanted(o, "nbfh-decay"))
+                    results.push_back(run("nbfh-decay", decayed(NaiveBayesFeatureHashing(ngram, lb), o.decay_epoch, o.decay),
+                                          ngram, 0, lb, train, test, settings));
+                if (wanted(o, "pfh"))
+                    results.push_back(run("pfh", PerceptronFeatureHashing(ngram, lb, 0.01),
+                                          ngram, 0, lb, train, test, settings));
+                if (wanted(o, "pfh-avg"))
+                    results.push_back(run("pfh-avg", averaged(PerceptronFeatureHashing(ngram, lb, 0.01)),
+                                          ngram, 0, lb, train, test, settings));
+                for (int k : o.num_hashes) {
+                    if (wanted(o, "nbcm"))
+                        results.push_back(run("nbcm", NaiveBayesCountMin(ngram, k, lb),
+                                              ngram, k, lb, train, test, settings));
+                    if (wanted(o, "nbcm-decay"))
+                        results.push_back(run("nbcm-decay", decayed(NaiveBayesCountMin(ngram, k, lb), o.decay_epoch, o.decay),
+                                              ngram, k, lb, train, test, settings));
+                    if (wanted(o, "pcm"))
+                        results.push_back(run("pcm", PerceptronCountMin(ngram, k, lb, 0.01),
+                                              ngram, k, lb, train, test, settings));
+                    if (wanted(o, "pcm-avg"))
+                        results.push_back(run("pcm-avg", averaged(PerceptronCountMin(ngram, k, lb, 0.01)),
+                                              ngram, k, lb, train, test, settings));
+                    if (wanted(o, "ens")) {
+                        Ensemble<NaiveBayesFeatureHashing, NaiveBayesCountMin, PerceptronFeatureHashing, PerceptronCountMin>
+                            ens({NaiveBayesFeatureHashing(ngram, lb), NaiveBayesCountMin(ngram, k, lb),
+                                 PerceptronFeatureHashing(ngram, lb, 0.01), PerceptronCountMin(ngram, k, lb, 0.01)},
+                                {1.0, 1.0, 1.0, 1.0}, EnsembleCombine::Vote);
+                        results.push_back(run("ens", ens, ngram, k, lb, train, test, settings));
+                    }
+                    dispatch_num_hashes(k, [&](auto rows) {
+                        constexpr int R = decltype(rows)::value;
+                        if (wanted(o, "nbcm-rows"))
+                            results.push_back(run("nbcm-rows", BasicNaiveBayesCountMin<int, R>(ngram, k, lb),
+                                                  ngram, k, lb, train, test, settings));
+                        if (wanted(o, "pcm-rows"))
+                            results.push_back(run("pcm-rows", BasicPerceptronCountMin<double, double, R>(ngram, k, lb, 0.01),
+                                                  ngram, k, lb, train, test, settings));
+                    });
+                }
+            }
+        }
+    }
+
+    return results;
+}
+
+// the grid of nbfh and nbcm with every cell type, named like nbcm-u8
+std::vector<Result> run_counters(const Options& o, const std::vector<Settings>& settings_list,
+                                 const Stream& train, const Stream& test)
+{
+    std::vector<Result> results;
+    for (const Settings& settings : settings_list) {
+        for (int ngram : o.ngram) {
+            for (int lb : o.log_buckets) {
+                for_each_cell_type([&](const std::string& cell, auto c) {
+                    using Count = decltype(c);
+                    if (wanted(o, "nbfh"))
+                        results.push_back(run("nbfh-" + cell, BasicNaiveBayesFeatureHashing<Count>(ngram, lb),
+                                              ngram, 0, lb, train, test, settings));
+                    for (int k : o.num_hashes)
+                        if (wanted(o, "nbcm"))
+                            results.push_back(run("nbcm-" + cell, BasicNaiveBayesCountMin<Count>(ngram, k, lb),
+                                                  ngram, k, lb, train, test, settings));
+                });
+            }
+        }
+    }
+    return results;
+}
+
+// the nbcm grid under every update and query policy of count_min_sketch.hpp, named
+// like nbcm-conservative-min; memory_bytes only depends on --num-hashes and --log-buckets
+std::vector<Result> run_policies(const Options& o, const std::vector<Settings>& settings_list,
+                                 const Stream& train, const Stream& test)
+{
+    const std::pair<std::string, SketchUpdate> updates[] = {
+        {"standard", SketchUpdate::Standard}, {"conservative", SketchUpdate::Conservative}};
+    const std::pair<std::string, SketchQuery> queries[] = {
+        {"min", SketchQuery::Min}, {"cmm", SketchQuery::CountMeanMin}};
+    std::vector<Result> results;
+    for (const Settings& settings : settings_list) {
+        for (int ngram : o.ngram) {
+            for (int k : o.num_hashes) {
+                for (int lb : o.log_buckets) {
+                    for (const auto& [update_name, update] : updates) {
+                        for (const auto& [query_name, query] : queries) {
+                            NaiveBayesCountMin clf(ngram, k, lb);
+                            clf.set_sketch_policy(update, query);
+                            results.push_back(run("nbcm-" + update_name + "-" + query_name, std::move(clf),
+                                                  ngram, k, lb, train, test, settings));
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return results;
+}
+
+} // namespace bench
+} // namespace bdap
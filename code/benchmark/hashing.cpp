@@ -0,0 +1,54 @@
+#include <string>
+#include <vector>
+#include "benchmark/benchmark.hpp"
+#include "hashing.hpp"
+
+namespace bdap {
+namespace bench {
+
+// emails/sec of a prequential pass (predict, then update) over the training
+// stream: with predict and update hashing the email each (email), hashing it
+// once into the reused per-thread buffer (hash-once) and once into a new
+// buffer per email (fresh-buffer), which allocates
+std::vector<Row> run_hashing(const Options& o, const Stream& train) {
+    std::vector<Email> emails = to_emails(train);
+    std::vector<Row> rows;
+    for_each_classifier(o, [&](const std::string& name, const auto& empty, int ngram, int k, int lb) {
+        auto time_pass = [&](const std::string& api, auto step) {
+            auto clf = empty;
+            clf.set_dedup(o.dedup);
+            double sum = 0.0;
+            double s = seconds([&] {
+                for (const Email& email : emails)
+                    sum += step(clf, email);
+            });
+            keep(static_cast<long long>(sum));
+            rows.push_back(Row().add("classifier", name).add("ngram", ngram).add("num_hashes", k)
+                                .add("log_num_buckets", lb).add("api", api)
+                                .add("emails_per_sec", emails.size() / s));
+        };
+        time_pass("email", [](auto& clf, const Email& email) {
+            double score = clf.predict(email);
+            clf.update(email);
+            return score;
+        });
+        time_pass("hash-once", [](auto& clf, const Email& email) {
+            NgramHashes& hashes = scratch_ngram_hashes();
+            clf.hash_email(email, hashes);
+            double score = clf.predict_hashes(hashes);
+            clf.update_hashes(hashes, email.is_spam());
+            return score;
+        });
+        time_pass("fresh-buffer", [](auto& clf, const Email& email) {
+            NgramHashes hashes;
+            clf.hash_email(email, hashes);
+            double score = clf.predict_hashes(hashes);
+            clf.update_hashes(hashes, email.is_spam());
+            return score;
+        });
+    });
+    return rows;
+}
+
+} // namespace bench
+} // namespace bdap
@@ -0,0 +1,209 @@
+#include <algorithm>
+#include <climits>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "benchmark/benchmark.hpp"
+#include "count_min_sketch.hpp"
+#include "hashing.hpp"
+
+namespace bdap {
+namespace bench {
+
+namespace {
+
+// the n-gram hashes of all emails of a stream, one after the other
+struct StreamHashes {
+    std::vector<size_t> hashes;
+    std::vector<size_t> ends; // of every email in hashes
+    std::vector<bool> is_spam;
+};
+
+StreamHashes hash_stream(const Stream& stream, int ngram, int seed) {
+    StreamHashes out;
+    NgramHashes hashes;
+    for (const EmailView& email : stream.emails) {
+        hashes.fill(email, ngram, seed);
+        out.hashes.insert(out.hashes.end(), hashes.begin(), hashes.end());
+        out.ends.push_back(out.hashes.size());
+        out.is_spam.push_back(email.is_spam());
+    }
+    return out;
+}
+
+// naive bayes counts in one CountMinSketch, see --mode layout
+class PairedSketch {
+    CountMinSketch<int> cms_;
+
+public:
+    PairedSketch(int num_rows, int log_num_buckets) : cms_(num_rows, log_num_buckets) {}
+
+    void add(const RowHasher& rows, const RowHasher::Probe& p, bool is_spam) {
+        for (int i = 0; i < cms_.num_rows(); ++i) {
+            CountMinSketch<int>::Cell& c = cms_.at(i, rows.bucket(p, i));
+            ++(is_spam ? c.first : c.second);
+        }
+    }
+
+    std::pair<int, int> query(const RowHasher& rows, const RowHasher::Probe& p) const {
+        std::pair<int, int> m(INT_MAX, INT_MAX);
+        for (int i = 0; i < cms_.num_rows(); ++i) {
+            const CountMinSketch<int>::Cell& c = cms_.at(i, rows.bucket(p, i));
+            m.first = std::min(m.first, c.first);
+            m.second = std::min(m.second, c.second);
+        }
+        return m;
+    }
+};
+
+// the same counts in a vector per row and per class, as the Count-Min
+// classifiers kept them before CountMinSketch
+class SplitSketch {
+    std::vector<std::vector<int>> spam_;
+    std::vector<std::vector<int>> ham_;
+
+public:
+    SplitSketch(int num_rows, int log_num_buckets)
+        : spam_(num_rows, std::vector<int>(static_cast<size_t>(1) << log_num_buckets))
+        , ham_(num_rows, std::vector<int>(static_cast<size_t>(1) << log_num_buckets))
+    {}
+
+    void add(const RowHasher& rows, const RowHasher::Probe& p, bool is_spam) {
+        std::vector<std::vector<int>>& cms = is_spam ? spam_ : ham_;
+        for (size_t i = 0; i < cms.size(); ++i)
+            ++cms[i][rows.bucket(p, static_cast<int>(i))];
+    }
+
+    std::pair<int, int> query(const RowHasher& rows, const RowHasher::Probe& p) const {
+        std::pair<int, int> m(INT_MAX, INT_MAX);
+        for (size_t i = 0; i < spam_.size(); ++i) {
+            size_t b = rows.bucket(p, static_cast<int>(i));
+            m.first = std::min(m.first, spam_[i][b]);
+            m.second = std::min(m.second, ham_[i][b]);
+        }
+        return m;
+    }
+};
+
+template <typename Sketch>
+Row run_layout(const std::string& layout, Sketch sketch, int ngram, int num_hashes, int log_buckets,
+               const StreamHashes& train, const StreamHashes& test)
+{
+    RowHasher rows(0, log_buckets);
+    double update_s = seconds([&] {
+        size_t j = 0;
+        for (size_t e = 0; e < train.ends.size(); ++e)
+            for (; j < train.ends[e]; ++j)
+                sketch.add(rows, rows.probe(train.hashes[j]), train.is_spam[e]);
+    });
+    long long sum = 0;
+    double predict_s = seconds([&] {
+        for (size_t h : test.hashes) {
+            std::pair<int, int> m = sketch.query(rows, rows.probe(h));
+            sum += m.first - m.second;
+        }
+    });
+    keep(sum);
+    return Row().add("layout", layout).add("ngram", ngram).add("num_hashes", num_hashes)
+                .add("log_num_buckets", log_buckets)
+                .add("update_ngrams_per_sec", train.hashes.size() / update_s)
+                .add("predict_ngrams_per_sec", test.hashes.size() / predict_s);
+}
+
+template <typename Lookup>
+Row run_lookups(const std::string& classifier, const std::string& hashing, int ngram, int num_hashes,
+                int log_buckets, const Stream& stream, Lookup lookup)
+{
+    long long sum = 0;
+    size_t n = 0;
+    double s = seconds([&] {
+        for (const EmailView& email : stream.emails) {
+            for (EmailIter it(email.body(), ngram); it; ++n)
+                sum += lookup(it.next());
+        }
+    });
+    keep(sum);
+    return Row().add("classifier", classifier).add("hashing", hashing).add("ngram", ngram)
+                .add("num_hashes", num_hashes).add("log_num_buckets", log_buckets)
+                .add("ngrams_per_sec", n / s);
+}
+
+} // namespace
+
+// the Count-Min counts with both classes of a bucket next to each other against
+// a table per row and per class
+std::vector<Row> run_layouts(const Options& o, const Stream& train, const Stream& test) {
+    std::vector<Row> rows;
+    for (int ngram : o.ngram) {
+        StreamHashes train_hashes = hash_stream(train, ngram, 0);
+        StreamHashes test_hashes = hash_stream(test, ngram, 0);
+        for (int k : o.num_hashes) {
+            for (int lb : o.log_buckets) {
+                rows.push_back(run_layout("paired", PairedSketch(k, lb), ngram, k, lb, train_hashes, test_hashes));
+                rows.push_back(run_layout("split", SplitSketch(k, lb), ngram, k, lb, train_hashes, test_hashes));
+            }
+        }
+    }
+    return rows;
+}
+
+// n-grams/sec of reading the cells of every n-gram of the test stream with the
+// buckets of one hash per row, hash(ngram, i) % num_buckets, as the Count-Min
+// classifiers did before RowHasher, against one hash per n-gram and RowHasher.
+// The perceptron hashed twice per row, for its weights and for its counts.
+std::vector<Row> run_row_hashing(const Options& o, const Stream& test) {
+    std::vector<Row> rows;
+    for (int ngram : o.ngram) {
+        for (int k : o.num_hashes) {
+            for (int lb : o.log_buckets) {
+                CountMinSketch<int> counts(k, lb);
+                CountMinSketch<double> weights(k, lb);
+                RowHasher hasher(0, lb);
+                size_t num_buckets = counts.num_buckets();
+
+                rows.push_back(run_lookups("nbcm", "per-row", ngram, k, lb, test, [&](std::string_view g) {
+                    int spam = INT_MAX, ham = INT_MAX;
+                    for (int i = 0; i < k; ++i) {
+                        const CountMinSketch<int>::Cell& c = counts.at(i, hash(g, i) % num_buckets);
+                        spam = std::min(spam, c.first);
+                        ham = std::min(ham, c.second);
+                    }
+                    return static_cast<long long>(spam - ham);
+                }));
+                rows.push_back(run_lookups("nbcm", "single", ngram, k, lb, test, [&](std::string_view g) {
+                    RowHasher::Probe p = hasher.probe(g);
+                    int spam = INT_MAX, ham = INT_MAX;
+                    for (int i = 0; i < k; ++i) {
+                        const CountMinSketch<int>::Cell& c = counts.at(i, hasher.bucket(p, i));
+                        spam = std::min(spam, c.first);
+                        ham = std::min(ham, c.second);
+                    }
+                    return static_cast<long long>(spam - ham);
+                }));
+                rows.push_back(run_lookups("pcm", "per-row", ngram, k, lb, test, [&](std::string_view g) {
+                    double w = 0.0, c = 0.0;
+                    for (int i = 0; i < k; ++i)
+                        w += weights.at(i, hash(g, i) % num_buckets).first;
+                    for (int i = 0; i < k; ++i)
+                        c += weights.at(i, hash(g, i) % num_buckets).second;
+                    return static_cast<long long>(w + c);
+                }));
+                rows.push_back(run_lookups("pcm", "single", ngram, k, lb, test, [&](std::string_view g) {
+                    RowHasher::Probe p = hasher.probe(g);
+                    double w = 0.0, c = 0.0;
+                    for (int i = 0; i < k; ++i) {
+                        const CountMinSketch<double>::Cell& cell = weights.at(i, hasher.bucket(p, i));
+                        w += cell.first;
+                        c += cell.second;
+                    }
+                    return static_cast<long long>(w + c);
+                }));
+            }
+        }
+    }
+    return rows;
+}
+
+} // namespace bench
+} // namespace bdap
@@ -0,0 +1,135 @@
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "benchmark/benchmark.hpp"
+#include "concurrent.hpp"
+#include "metrics.hpp"
+#include "parallel.hpp"
+#include "sharded_training.hpp"
+
+namespace bdap {
+namespace bench {
+
+namespace {
+
+bool same_counts(const ConfusionMatrix& a, const ConfusionMatrix& b) {
+    return a.true_pos == b.true_pos && a.false_pos == b.false_pos
+        && a.true_neg == b.true_neg && a.false_neg == b.false_neg;
+}
+
+} // namespace
+
+// emails/sec of ConfusionMatrix::evaluate_parallel on every number of --threads
+// against evaluate, with the classifiers trained on the training stream
+std::vector<Row> run_eval_scaling(const Options& o, const Stream& train, const Stream& test) {
+    std::vector<Email> emails = to_emails(test);
+    std::vector<Row> rows;
+    for_each_classifier(o, [&](const std::string& name, auto clf, int ngram, int k, int lb) {
+        for (const EmailView& email : train.emails)
+            clf.update(email);
+        ConfusionMatrix serial;
+        double serial_s = seconds([&] { serial.evaluate(clf, emails); });
+        for (int t : o.threads) {
+            ConfusionMatrix m;
+            double s = seconds([&] { m.evaluate_parallel(clf, emails, t); });
+            rows.push_back(Row().add("classifier", name).add("ngram", ngram).add("num_hashes", k)
+                                .add("log_num_buckets", lb).add("threads", t)
+                                .add("emails_per_sec", emails.size() / s).add("speedup", serial_s / s)
+                                .add_bool("same_as_serial", same_counts(m, serial)));
+        }
+    });
+    return rows;
+}
+
+// emails/sec of train_sharded on every number of --threads, merging at the end
+// and every 1000 emails, against training serially; only nbfh and nbcm merge
+std::vector<Row> run_train_scaling(const Options& o, const Stream& train, const Stream& test) {
+    std::vector<Email> emails = to_emails(train);
+    std::vector<Row> rows;
+    auto scale = [&](const std::string& name, auto empty, int ngram, int k, int lb) {
+        auto serial = empty;
+        double serial_s = seconds([&] {
+            for (const Email& email : emails)
+                serial.update(email);
+        });
+        for (int t : o.threads) {
+            for (size_t merge_every : {size_t{0}, size_t{1000}}) {
+                auto model = empty;
+                double s = seconds([&] { train_sharded(model, emails, t, merge_every); });
+                bool same = true;
+                for (const EmailView& email : test.emails)
+                    same = same && model.predict(email) == serial.predict(email);
+                rows.push_back(Row().add("classifier", name).add("ngram", ngram).add("num_hashes", k)
+                                    .add("log_num_buckets", lb).add("threads", t)
+                                    .add("merge_every", merge_every)
+                                    .add("emails_per_sec", emails.size() / s).add("speedup", serial_s / s)
+                                    .add_bool("same_as_serial", same));
+            }
+        }
+    };
+    for (int ngram : o.ngram) {
+        for (int lb : o.log_buckets) {
+            if (wanted(o, "nbfh"))
+                scale("nbfh", NaiveBayesFeatureHashing(ngram, lb), ngram, 0, lb);
+            for (int k : o.num_hashes)
+                if (wanted(o, "nbcm"))
+                    scale("nbcm", NaiveBayesCountMin(ngram, k, lb), ngram, k, lb);
+        }
+    }
+    return rows;
+}
+
+// emails/sec scored through SnapshotClf by every number of --threads of readers,
+// alone and while a writer trains and publishes every 1 or 100 updates
+std::vector<Row> run_snapshot(const Options& o, const Stream& train, const Stream& test) {
+    std::vector<Email> updates = to_emails(train);
+    std::vector<Email> emails = to_emails(test);
+    std::vector<Row> rows;
+    for_each_classifier(o, [&](const std::string& name, auto clf, int ngram, int k, int lb) {
+        for (const Email& email : updates)
+            clf.update(email);
+        for (int t : o.threads) {
+            for (size_t publish_every : {size_t{0}, size_t{1}, size_t{100}}) {
+                bool writing = publish_every != 0;
+                SnapshotClf<decltype(clf)> snapshot(clf, publish_every);
+                std::atomic<bool> stop{false};
+                size_t num_updates = 0;
+                // the writer goes on training on the training stream until the readers are done
+                std::thread writer;
+                if (writing && !updates.empty()) {
+                    writer = std::thread([&] {
+                        for (; !stop.load(); ++num_updates)
+                            snapshot.update(updates[num_updates % updates.size()]);
+                    });
+                }
+                long long sum = 0;
+                std::mutex sum_mutex;
+                double s = seconds([&] {
+                    parallel_chunks(emails.size(), t, [&](int, size_t begin, size_t end) {
+                        long long spam = 0;
+                        for (size_t i = begin; i < end; ++i)
+                            spam += snapshot.classify(snapshot.predict(emails[i]));
+                        std::lock_guard<std::mutex> lock(sum_mutex);
+                        sum += spam;
+                    });
+                });
+                stop.store(true);
+                if (writer.joinable())
+                    writer.join();
+                keep(sum);
+                Row row;
+                row.add("classifier", name).add("ngram", ngram).add("num_hashes", k).add("log_num_buckets", lb)
+                   .add("readers", t).add_bool("writer", writing);
+                if (writing)
+                    row.add("publish_every", publish_every).add("updates_per_sec", num_updates / s);
+                rows.push_back(row.add("reads_per_sec", emails.size() / s));
+            }
+        }
+    });
+    return rows;
+}
+
+} // namespace bench
+} // namespace bdap
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include "email.hpp"
+
+namespace bdap {
+
+// Lets any number of threads score with predict while a single writer thread
+// keeps training with update, without a lock on the read path.
+//
+// The writer trains a private copy of the model and publishes it every
+// publish_every updates into one of two snapshots (double buffering).
+// Readers always score the most recently published snapshot. A reader
+// announces itself on the snapshot it uses; the writer only overwrites the
+// other snapshot, and waits for late readers of that one to leave. Readers
+// never wait on the writer.
+//
+// Meant for NaiveBayesFeatureHashing and PerceptronFeatureHashing, but works
+// for any copy-assignable classifier. Publishing copies the tables, so
+// publish_every trades freshness for writer throughput.
+template <typename Clf>
+class SnapshotClf {
+    Clf live_; // only touched by the writer
+    Clf snapshots_[2];
+    std::atomic<int> active_;
+    mutable std::atomic<int> readers_[2];
+    size_t publish_every_;
+    size_t pending_ = 0;
+    double threshold_; // of model, publish overwrites the snapshots under the readers
+
+public:
+    SnapshotClf(const Clf& model, size_t publish_every)
+        : live_(model)
+        , snapshots_{model, model}
+        , active_(0)
+        , publish_every_(publish_every == 0 ? 1 : publish_every)
+        , threshold_(model.threshold())
+    {
+        readers_[0].store(0);
+        readers_[1].store(0);
+    }
+
+    // writer side, a single thread only
+    void update(const Email& email) {
+        live_.update(email);
+        if (++pending_ >= publish_every_)
+            publish();
+    }
+
+    // make all updates so far visible to the readers
+    void publish() {
+        int next = 1 - active_.load();
+        // readers that picked next before the previous publish may still use it
+        while (readers_[next].load() != 0)
+            std::this_thread::yield();
+        snapshots_[next] = live_;
+        active_.store(next);
+        pending_ = 0;
+    }
+
+    // model the writer trains, do not use it from reader threads
+    const Clf& live() const { return live_; }
+
+    // reader side, any number of threads
+    double predict(const Email& email) const {
+        int cur;
+        for (;;) {
+            cur = active_.load();
+            readers_[cur].fetch_add(1);
+            // if the writer flipped in between, it may be about to overwrite cur
+            if (active_.load() == cur)
+                break;
+            readers_[cur].fetch_sub(1);
+        }
+        double pr = snapshots_[cur].predict(email);
+        readers_[cur].fetch_sub(1);
+        return pr;
+    }
+
+    // the model's classify, see BaseClf
+    bool classify(double pr) const { return pr > threshold_; }
+};
+
+} // namespace bdap
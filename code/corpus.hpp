@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <sys/mman.h>
+#include "email_view.hpp"
+#include "hashing.hpp"
+#include "mapped_file.hpp"
+
+// Streaming corpus reader. Instead of loading a corpus into a vector of Email
+// objects, the files are memory mapped and read one email at a time as an
+// EmailView straight over the mapped bytes, so memory stays flat however large
+// the corpus is. The classifiers take the views like Emails (see
+// train_corpus below).
+//
+// Corpus files hold one email per line: the label (1 = spam, 0 = ham), one
+// separator character (e.g. a comma or a tab), and the body up to the end of
+// the line. Lines that do not start with a label, such as a header, are
+// skipped.
+namespace bdap {
+
+class CorpusReader {
+    std::vector<std::string> paths_;
+    size_t next_file_ = 0;
+    std::unique_ptr<MappedFile> file_; // the file being read, null between files
+    size_t pos_ = 0;
+    size_t advised_ = 0; // the kernel was asked to read ahead up to here
+    size_t readahead_;
+    EmailView email_;
+
+public:
+    // readahead: how many bytes ahead of the reader the pages are requested
+    explicit CorpusReader(std::vector<std::string> paths, size_t readahead = 16 << 20)
+        : paths_(std::move(paths))
+        , readahead_(readahead == 0 ? 1 : readahead)
+    {}
+
+    explicit CorpusReader(const std::string& path, size_t readahead = 16 << 20)
+        : CorpusReader(std::vector<std::string>{path}, readahead)
+    {}
+
+    // The next email, or nullptr after the last one. The view points into the
+    // mapped file and stays valid until the following call.
+    const EmailView* next() {
+        for (;;) {
+            if (!file_) {
+                if (next_file_ == paths_.size())
+                    return nullptr;
+                open(paths_[next_file_++]);
+                if (file_->size() == 0) { // nothing to read, and no pages to advise
+                    file_.reset();
+                    continue;
+                }
+            }
+            const char* data = file_->data();
+            size_t size = file_->size();
+            if (pos_ >= size) {
+                file_.reset();
+                continue;
+            }
+
+            // keep the pages ahead of the reader on their way in, so the
+            // consumer does not wait on page faults
+            if (pos_ + readahead_ / 2 >= advised_) {
+                file_->advise(advised_, readahead_, MADV_WILLNEED);
+                advised_ += readahead_;
+            }
+
+            const char* line = data + pos_;
+            const char* eol = static_cast<const char*>(std::memchr(line, '\n', size - pos_));
+            size_t len = eol ? static_cast<size_t>(eol - line) : size - pos_;
+            pos_ += len + 1;
+            if (pos_ < size)
+                __builtin_prefetch(data + pos_);
+
+            if (len > 0 && line[len - 1] == '\r')
+                --len;
+            if (len < 2 || (line[0] != '0' && line[0] != '1'))
+                continue;
+            email_ = EmailView(line[0] == '1', std::string_view(line + 2, len - 2));
+            return &email_;
+        }
+    }
+
+    // start over at the first file
+    void rewind() {
+        file_.reset();
+        next_file_ = 0;
+    }
+
+private:
+    void open(const std::string& path) {
+        file_ = std::make_unique<MappedFile>(path);
+        file_->advise(0, file_->size(), MADV_SEQUENTIAL);
+        pos_ = 0;
+        advised_ = 0;
+    }
+};
+
+// trains clf on the rest of the corpus, returns the number of emails
+template <typename Clf>
+long long train_corpus(Clf& clf, CorpusReader& reader) {
+    long long n = 0;
+    while (const EmailView* email = reader.next()) {
+        clf.update(*email);
+        ++n;
+    }
+    return n;
+}
+
+} // namespace bdap
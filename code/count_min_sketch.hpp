@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstddef>
+#include <utility>
+#include "counters.hpp"
+#include "table.hpp"
+
+namespace bdap {
+
+// how an occurrence is added to the sketch
+enum class SketchUpdate {
+    Standard,     // increment the cell of every row
+    Conservative, // only increment the cells that hold the current minimum, the others already overestimate
+};
+
+// how a count is read back from the sketch
+enum class SketchQuery {
+    Min,          // min over the rows, never underestimates
+    CountMeanMin, // median over the rows of the count minus the expected collision noise, at most the min
+};
+
+// Count-Min sketch that keeps two values per cell (spam/ham counts for naive
+// bayes, weight/count for the perceptron); T and U are cell types from
+// counters.hpp. All rows live in one row-major buffer and both values of a
+// bucket sit next to each other, so one lookup touches one cache line.
+template <typename T, typename U = T>
+class CountMinSketch {
+public:
+    struct Cell {
+        T first;
+        U second;
+    };
+
+private:
+    int num_rows_;
+    int log_num_buckets_;
+    Table<Cell> cells_;
+
+public:
+    CountMinSketch(int num_rows, int log_num_buckets)
+        : num_rows_(num_rows)
+        , log_num_buckets_(log_num_buckets)
+        , cells_(static_cast<size_t>(num_rows) << log_num_buckets, Cell{}) // all cells start at 0
+    {}
+
+    // sketch over existing cells, e.g. borrowed from a mapped snapshot
+    CountMinSketch(int num_rows, int log_num_buckets, Table<Cell> cells)
+        : num_rows_(num_rows)
+        , log_num_buckets_(log_num_buckets)
+        , cells_(std::move(cells))
+    {}
+
+    int num_rows() const { return num_rows_; }
+    int log_num_buckets() const { return log_num_buckets_; }
+    size_t num_buckets() const { return static_cast<size_t>(1) << log_num_buckets_; }
+    size_t size() const { return cells_.size(); }
+
+    Cell& at(int row, size_t bucket) {
+        return cells_[(static_cast<size_t>(row) << log_num_buckets_) + bucket];
+    }
+    const Cell& at(int row, size_t bucket) const {
+        return cells_[(static_cast<size_t>(row) << log_num_buckets_) + bucket];
+    }
+
+    // element-wise sum, sketches built with the same hashes merge exactly this way
+    void add(const CountMinSketch& other) {
+        Cell* dst = cells_.data();
+        const Cell* src = other.cells_.data();
+        for (size_t i = 0; i < cells_.size(); ++i) {
+            add_to(dst[i].first, src[i].first);
+            add_to(dst[i].second, src[i].second);
+        }
+    }
+
+    void clear() { cells_.fill(Cell{}); }
+
+    // multiply both values of the cells [begin, end) of data() by factor, rounded by
+    // round_count; adds how much the counts changed to first_delta and second_delta
+    void scale(double factor, size_t begin, size_t end, long long& first_delta, long long& second_delta) {
+        Cell* cells = cells_.data();
+        for (size_t i = begin; i < end; ++i) {
+            auto first = count_value(cells[i].first);
+            auto second = count_value(cells[i].second);
+            cells[i].first = round_count<T>(first * factor);
+            cells[i].second = round_count<U>(second * factor);
+            first_delta += static_cast<long long>(count_value(cells[i].first) - first);
+            second_delta += static_cast<long long>(count_value(cells[i].second) - second);
+        }
+    }
+
+    bool same_shape(const CountMinSketch& other) const {
+        return num_rows_ == other.num_rows_ && log_num_buckets_ == other.log_num_buckets_;
+    }
+
+    Cell* data() { return cells_.data(); }
+    const Cell* data() const { return cells_.data(); }
+
+    const Table<Cell>& cells() const { return cells_; }
+
+    TableMemory memory() const { return cells_.memory(); }
+    void set_memory(const TableMemory& memory) { cells_.set_memory(memory); }
+};
+
+} // namespace bdap
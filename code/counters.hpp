@@ -0,0 +1,160 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <thread>
+#include <type_traits>
+
+// Cell types for the classifier tables. Besides plain int/float/double the
+// tables can hold small saturating counters or Morris approximate counters,
+// trading accuracy for memory. Every cell type supports:
+//
+//   count_value(c)  the value of the cell
+//   increment(c)    add one occurrence
+//   increment(c, n) add n occurrences, the same as n times increment(c)
+//   increment_delta(c, n)  the same, returns by how much count_value(c) grew
+//   add_to(a, b)    a += b, used to merge models
+//   T(v)            a cell holding (about) v
+//   round_count<T>(v)  a cell holding v on average, used to decay
+namespace bdap {
+
+// unsigned counter that sticks at its maximum instead of wrapping around
+template <typename UInt>
+class SaturatingCounter {
+    static_assert(std::is_unsigned<UInt>::value, "SaturatingCounter needs an unsigned type");
+    UInt c_ = 0;
+
+public:
+    SaturatingCounter() = default;
+    SaturatingCounter(long long v)
+        : c_(v <= 0 ? 0 : v >= max_value() ? std::numeric_limits<UInt>::max() : static_cast<UInt>(v))
+    {}
+
+    static constexpr long long max_value() { return std::numeric_limits<UInt>::max(); }
+
+    long long value() const { return c_; }
+    void increment() {
+        if (c_ != std::numeric_limits<UInt>::max())
+            ++c_;
+    }
+};
+
+// Morris counter: stores an exponent e and estimates the count as 2^e - 1.
+// Each occurrence raises e with probability 2^-e, so the estimate is unbiased
+// and one byte counts up to 2^30.
+class MorrisCounter {
+    uint8_t e_ = 0;
+
+    static constexpr int max_exponent = 30;
+
+    // xorshift64, one stream per thread
+    static uint64_t random_bits() {
+        thread_local uint64_t state = thread_seed();
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+
+    // threads that train replicas of one model (see train_sharded) must not all
+    // draw the same bits, so the stream starts from the mixed thread id
+    static uint64_t thread_seed() {
+        uint64_t s = 0x9e3779b97f4a7c15ULL ^ std::hash<std::thread::id>()(std::this_thread::get_id());
+        s = (s ^ (s >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        s = (s ^ (s >> 27)) * 0x94d049bb133111ebULL;
+        s ^= s >> 31;
+        return s != 0 ? s : 0x9e3779b97f4a7c15ULL; // xorshift stays at 0
+    }
+
+public:
+    MorrisCounter() = default;
+    MorrisCounter(long long v) {
+        int e = v <= 0 ? 0 : static_cast<int>(std::lround(std::log2(static_cast<double>(v) + 1.0)));
+        e_ = static_cast<uint8_t>(e > max_exponent ? max_exponent : e);
+    }
+
+    // A counter whose estimate is v on average: one of the two estimates around v,
+    // the upper one with probability (v - lower) / (upper - lower). T(v) takes the
+    // nearest exponent instead, so scaling by a factor above about 0.7 would never
+    // lower a counter.
+    static MorrisCounter rounded(double v) {
+        MorrisCounter c;
+        if (v <= 0.0)
+            return c;
+        int e = static_cast<int>(std::floor(std::log2(v + 1.0)));
+        if (e >= max_exponent) {
+            c.e_ = max_exponent;
+            return c;
+        }
+        // the estimates 2^e - 1 <= v < 2^(e+1) - 1 are 2^e apart
+        double p = (v - static_cast<double>((1LL << e) - 1)) / static_cast<double>(1LL << e);
+        double uniform = static_cast<double>(random_bits() >> 11) * 0x1.0p-53;
+        c.e_ = static_cast<uint8_t>(uniform < p ? e + 1 : e);
+        return c;
+    }
+
+    long long value() const { return (1LL << e_) - 1; }
+    void increment() {
+        if (e_ < max_exponent && (random_bits() & ((1ULL << e_) - 1)) == 0)
+            ++e_;
+    }
+};
+
+template <typename T>
+typename std::enable_if<std::is_arithmetic<T>::value, T>::type count_value(T c) { return c; }
+
+template <typename T>
+auto count_value(const T& c) -> decltype(c.value()) { return c.value(); }
+
+template <typename T>
+typename std::enable_if<std::is_arithmetic<T>::value>::type increment(T& c) { ++c; }
+
+template <typename T>
+auto increment(T& c) -> decltype(c.increment()) { c.increment(); }
+
+template <typename T>
+typename std::enable_if<std::is_arithmetic<T>::value>::type increment(T& c, int n) { c += n; }
+
+// the approximate counters count every occurrence on its own
+template <typename T>
+auto increment(T& c, int n) -> decltype(c.increment()) {
+    for (int i = 0; i < n; ++i)
+        c.increment();
+}
+
+// increment(c, n) and return by how much the value of c grew: n, except for a
+// saturating counter at its maximum or a Morris counter, whose estimate jumps.
+// The classifiers add it to their totals, which so stay the sums of their cells.
+template <typename T>
+long long increment_delta(T& c, int n) {
+    auto before = count_value(c);
+    increment(c, n);
+    return static_cast<long long>(count_value(c) - before);
+}
+
+template <typename T>
+void add_to(T& a, const T& b) { a = T(count_value(a) + count_value(b)); }
+
+// T(v), which rounds integer counts down, except for Morris counters, which
+// round at random so that decay lowers them too, see MorrisCounter::rounded
+template <typename T>
+T round_count(double v) { return T(v); }
+
+template <>
+inline MorrisCounter round_count<MorrisCounter>(double v) { return MorrisCounter::rounded(v); }
+
+// tag stored in model snapshots, so a model is only loaded with the cell types it was saved with
+template <typename T> struct CellTypeCode;
+template <> struct CellTypeCode<int> { static constexpr uint32_t value = 1; };
+template <> struct CellTypeCode<float> { static constexpr uint32_t value = 2; };
+template <> struct CellTypeCode<double> { static constexpr uint32_t value = 3; };
+template <> struct CellTypeCode<SaturatingCounter<uint8_t>> { static constexpr uint32_t value = 4; };
+template <> struct CellTypeCode<SaturatingCounter<uint16_t>> { static constexpr uint32_t value = 5; };
+template <> struct CellTypeCode<MorrisCounter> { static constexpr uint32_t value = 6; };
+
+template <typename A, typename B>
+constexpr uint32_t cell_types_code() { return CellTypeCode<A>::value | (CellTypeCode<B>::value << 8); }
+
+} // namespace bdap
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <type_traits>
+#include <utility>
+
+// Dispatch of a runtime num_hashes to the Count-Min classifiers specialized
+// on it (the Rows template argument of BasicNaiveBayesCountMin and
+// BasicPerceptronCountMin), e.g.
+//
+//   dispatch_num_hashes(num_hashes, [&](auto rows) {
+//       BasicNaiveBayesCountMin<int, decltype(rows)::value> clf(ngram, num_hashes, log_num_buckets);
+//       ...
+//   });
+//
+// fn gets a std::integral_constant<int, num_hashes> for the common values
+// and std::integral_constant<int, 0> (the runtime version) for the others,
+// so every value works and the common ones are unrolled.
+namespace bdap {
+
+// the num_hashes values that get their own instantiation
+using specialized_num_hashes = std::integer_sequence<int, 1, 2, 3, 4, 5, 6, 8>;
+
+template <typename Fn, int... K>
+decltype(auto) dispatch_num_hashes(int num_hashes, Fn&& fn, std::integer_sequence<int, K...>) {
+    using Result = decltype(fn(std::integral_constant<int, 0>()));
+    if constexpr (std::is_void<Result>::value) {
+        bool done = ((num_hashes == K ? (fn(std::integral_constant<int, K>()), true) : false) || ...);
+        if (!done)
+            fn(std::integral_constant<int, 0>());
+    } else {
+        Result result{};
+        bool done = ((num_hashes == K ? (result = fn(std::integral_constant<int, K>()), true) : false) || ...);
+        if (!done)
+            result = fn(std::integral_constant<int, 0>());
+        return result;
+    }
+}
+
+template <typename Fn>
+decltype(auto) dispatch_num_hashes(int num_hashes, Fn&& fn) {
+    return dispatch_num_hashes(num_hashes, std::forward<Fn>(fn), specialized_num_hashes());
+}
+
+} // namespace bdap
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace bdap {
+
+// An email: its label and its body. The classifiers only look at the body
+// through the character n-grams of EmailIter.
+class Email {
+    bool is_spam_ = false;
+    std::string body_;
+
+public:
+    Email() = default;
+    Email(bool is_spam, std::string body) : is_spam_(is_spam), body_(std::move(body)) {}
+
+    bool is_spam() const { return is_spam_; }
+    std::string_view body() const { return body_; }
+};
+
+// walks the character n-grams of an email body (of an Email or an EmailView),
+// one byte at a time:
+//
+//   EmailIter it(email.body(), 3);
+//   while (it)
+//       use(it.next());
+class EmailIter {
+    std::string_view body_;
+    size_t ngram_;
+    size_t pos_ = 0;
+
+public:
+    EmailIter(std::string_view body, int ngram)
+        : body_(body), ngram_(static_cast<size_t>(ngram)) {}
+
+    EmailIter(const Email& email, int ngram) : EmailIter(email.body(), ngram) {}
+
+    explicit operator bool() const { return pos_ + ngram_ <= body_.size(); }
+    std::string_view next() { return body_.substr(pos_++, ngram_); }
+};
+
+// MurmurHash64A of the bytes of s, seeded with seed
+inline size_t hash(std::string_view s, int seed) {
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    uint64_t h = static_cast<uint64_t>(static_cast<uint32_t>(seed)) ^ (s.size() * m);
+
+    const char* p = s.data();
+    size_t n = s.size();
+    for (; n >= 8; n -= 8, p += 8) {
+        uint64_t k;
+        std::memcpy(&k, p, 8);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+    switch (n) {
+    case 7: h ^= static_cast<uint64_t>(static_cast<unsigned char>(p[6])) << 48; [[fallthrough]];
+    case 6: h ^= static_cast<uint64_t>(static_cast<unsigned char>(p[5])) << 40; [[fallthrough]];
+    case 5: h ^= static_cast<uint64_t>(static_cast<unsigned char>(p[4])) << 32; [[fallthrough]];
+    case 4: h ^= static_cast<uint64_t>(static_cast<unsigned char>(p[3])) << 24; [[fallthrough]];
+    case 3: h ^= static_cast<uint64_t>(static_cast<unsigned char>(p[2])) << 16; [[fallthrough]];
+    case 2: h ^= static_cast<uint64_t>(static_cast<unsigned char>(p[1])) << 8; [[fallthrough]];
+    case 1: h ^= static_cast<uint64_t>(static_cast<unsigned char>(p[0]));
+            h *= m;
+    }
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return static_cast<size_t>(h);
+}
+
+} // namespace bdap
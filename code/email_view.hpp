@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+
+namespace bdap {
+
+// An email that does not own its body: the label plus a view on bytes that
+// live elsewhere, e.g. a mapped corpus file (see corpus.hpp). The classifiers
+// take it like an Email, in update, predict and the batch calls.
+class EmailView {
+    bool is_spam_ = false;
+    std::string_view body_;
+
+public:
+    EmailView() = default;
+    EmailView(bool is_spam, std::string_view body) : is_spam_(is_spam), body_(body) {}
+
+    bool is_spam() const { return is_spam_; }
+    std::string_view body() const { return body_; }
+};
+
+} // namespace bdap
@@ -0,0 +1,237 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include "email.hpp"
+#include "base_classifier.hpp"
+#include "email_view.hpp"
+#include "hashing.hpp"
+#include "instrumentation.hpp"
+#include "table_memory.hpp"
+
+namespace bdap {
+
+// how Ensemble combines the scores of its members
+enum class EnsembleCombine {
+    Sum, // weighted sum of the scores
+    Vote // weighted sum of +1 (spam) and -1 (ham), each member by its own threshold
+};
+
+// Several models, any mix of the four classifiers and configurations, scored
+// and trained as one. The email is hashed once for all of them instead of once
+// per member: members with the same ngram_config (n-gram size, seed, dedup)
+// read the same NgramHashes, and the n-grams of every n-gram size are walked
+// once, with one hash per distinct seed (see NgramHashes::fill_all). The
+// default seeds put both naive bayes models on one hash and both perceptrons
+// on another, so four members of one n-gram size cost one pass and two hashes
+// per n-gram, plus their own table lookups.
+//
+// The members read different hashes, so an Ensemble has no hash_email,
+// predict_hashes or ngram_config. update and predict take Emails and
+// EmailViews, and update_batch and predict_batch (so also ScoringEngine) go
+// email by email. Prequential scores and trains it with predict and update.
+//
+// The score is the weighted combination of the member scores, classified
+// against threshold. With Sum the weights also have to bring the scores to a
+// common scale (naive bayes scores are log-likelihood ratios, perceptron
+// scores are dot products) and the threshold has to absorb the members' own
+// thresholds; Vote only needs the weights.
+//
+//   Ensemble<NaiveBayesFeatureHashing, PerceptronCountMin> ens(
+//       {NaiveBayesFeatureHashing(3, 20), PerceptronCountMin(3, 4, 20, 0.01)}, {1.0, 1.0},
+//       EnsembleCombine::Vote);
+template <typename... Clfs>
+class Ensemble : public BaseClf<Ensemble<Clfs...>> {
+    static constexpr size_t N = sizeof...(Clfs);
+
+    std::tuple<Clfs...> members_;
+    std::array<double, N> weights_;
+    EnsembleCombine combine_;
+
+    // which members share their hashes
+    struct Plan {
+        std::array<NgramConfig, N> configs; // of each group of members
+        std::array<size_t, N> group;        // of each member
+        size_t num_groups = 0;
+    };
+
+    // Worked out once and again after set_dedup. A member handed out by the
+    // non-const member() may have its config changed, so that marks the plan
+    // stale; train rebuilds it, score works one out per email until then.
+    Plan plan_;
+    bool plan_stale_ = false;
+
+public:
+    Ensemble(std::tuple<Clfs...> members, const std::array<double, N>& weights,
+             EnsembleCombine combine = EnsembleCombine::Sum, double threshold = 0.0)
+        : BaseClf<Ensemble>(threshold)
+        , members_(std::move(members))
+        , weights_(weights)
+        , combine_(combine)
+        , plan_(make_plan())
+    {}
+
+    template <typename E>
+    void update_(const E& email) {
+        BDAP_STAT_TIMER(update_ns);
+        train(email);
+    }
+
+    template <typename E>
+    double predict_(const E& email) const {
+        BDAP_STAT_TIMER(predict_ns);
+        return score(email);
+    }
+
+    // the batches go email by email, each hashed once for all members
+    template <typename E>
+    void update_batch_(const E* emails, size_t n) {
+        for (size_t i = 0; i < n; ++i)
+            train(emails[i]);
+    }
+
+    template <typename E>
+    void predict_batch_(const E* emails, size_t n, double* scores) const {
+        for (size_t i = 0; i < n; ++i)
+            scores[i] = score(emails[i]);
+    }
+
+    // update_ and predict_ without the timers
+    // the members count their table lookups in the stats, the email counts once
+    template <typename E>
+    void train(const E& email) {
+        BDAP_STAT_EMAIL(emails_updated);
+        BDAP_STAT_NESTED();
+        if (plan_stale_) {
+            plan_ = make_plan();
+            plan_stale_ = false;
+        }
+        std::vector<NgramHashes>& hashes = scratch_hashes();
+        hash_all(email, plan_, hashes);
+        for_each_member([&](auto& member, size_t i) {
+            member.update_hashes(hashes[plan_.group[i]], email.is_spam());
+        });
+    }
+
+    template <typename E>
+    double score(const E& email) const {
+        BDAP_STAT_EMAIL(emails_predicted);
+        BDAP_STAT_NESTED();
+        Plan stale_plan;
+        if (plan_stale_)
+            stale_plan = make_plan();
+        const Plan& plan = plan_stale_ ? stale_plan : plan_;
+        std::vector<NgramHashes>& hashes = scratch_hashes();
+        hash_all(email, plan, hashes);
+        double s = 0.0;
+        for_each_member([&](const auto& member, size_t i) {
+            double x = member.predict_hashes(hashes[plan.group[i]]);
+            if (combine_ == EnsembleCombine::Vote)
+                x = member.classify(x) ? 1.0 : -1.0;
+            s += weights_[i] * x;
+        });
+        return s;
+    }
+
+    template <size_t I>
+    auto& member() {
+        plan_stale_ = true;
+        return std::get<I>(members_);
+    }
+
+    template <size_t I>
+    const auto& member() const { return std::get<I>(members_); }
+
+    void set_weights(const std::array<double, N>& weights) { weights_ = weights; }
+
+    // set_dedup of every member
+    void set_dedup(bool dedup) {
+        for_each_member([dedup](auto& member, size_t) { member.set_dedup(dedup); });
+        plan_ = make_plan();
+        plan_stale_ = false;
+    }
+
+    // set_table_memory of every member
+    void set_table_memory(const TableMemory& memory) {
+        for_each_member([&memory](auto& member, size_t) { member.set_table_memory(memory); });
+    }
+
+    size_t memory_bytes() const {
+        size_t bytes = 0;
+        for_each_member([&bytes](const auto& member, size_t) { bytes += member.memory_bytes(); });
+        return bytes;
+    }
+
+    // the occupancy of the member with the most collisions
+    TableStats table_stats() const {
+        TableStats worst;
+        for_each_member([&worst](const auto& member, size_t i) {
+            TableStats s = member.table_stats();
+            if (i == 0 || s.collision_rate > worst.collision_rate)
+                worst = s;
+        });
+        return worst;
+    }
+
+private:
+    Plan make_plan() const {
+        Plan plan;
+        for_each_member([&plan](const auto& member, size_t i) {
+            NgramConfig config = member.ngram_config();
+            size_t g = std::find(plan.configs.begin(), plan.configs.begin() + plan.num_groups, config)
+                       - plan.configs.begin();
+            if (g == plan.num_groups)
+                plan.configs[plan.num_groups++] = config;
+            plan.group[i] = g;
+        });
+        return plan;
+    }
+
+    // fill hashes[g] for every group g, one pass over the n-grams per n-gram size
+    template <typename E>
+    static void hash_all(const E& email, const Plan& plan, std::vector<NgramHashes>& hashes) {
+        std::array<bool, N> done{};
+        for (size_t g = 0; g < plan.num_groups; ++g) {
+            if (done[g])
+                continue;
+            std::array<NgramConfig, N> configs;
+            std::array<NgramHashes*, N> out;
+            size_t n = 0;
+            for (size_t h = g; h < plan.num_groups; ++h) {
+                if (!done[h] && plan.configs[h].ngram == plan.configs[g].ngram) {
+                    configs[n] = plan.configs[h];
+                    out[n++] = &hashes[h];
+                    done[h] = true;
+                }
+            }
+            if (n == 1)
+                hashes[g].fill(email, configs[0].ngram, configs[0].seed, configs[0].dedup);
+            else
+                NgramHashes::fill_all(email, configs.data(), out.data(), n);
+        }
+    }
+
+    // per-thread hash buffers, one per group
+    static std::vector<NgramHashes>& scratch_hashes() {
+        thread_local std::vector<NgramHashes> hashes(N);
+        return hashes;
+    }
+
+    template <typename F>
+    void for_each_member(F&& f) { for_each_member(f, std::index_sequence_for<Clfs...>()); }
+
+    template <typename F>
+    void for_each_member(F&& f) const { for_each_member(f, std::index_sequence_for<Clfs...>()); }
+
+    template <typename F, size_t... I>
+    void for_each_member(F& f, std::index_sequence<I...>) { (f(std::get<I>(members_), I), ...); }
+
+    template <typename F, size_t... I>
+    void for_each_member(F& f, std::index_sequence<I...>) const { (f(std::get<I>(members_), I), ...); }
+};
+
+} // namespace bdap
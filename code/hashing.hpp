@@ -0,0 +1,245 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+#include "email.hpp"
+#include "email_view.hpp"
+#include "instrumentation.hpp"
+
+namespace bdap {
+
+// finalizer of splitmix64, used to get a second independent hash out of the first one
+inline uint64_t mix_hash(uint64_t h) {
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+// Hashes an n-gram once and derives the bucket of every Count-Min row from
+// that single hash with double hashing: bucket_i = (h1 + i * h2) & mask.
+// The number of buckets is a power of two, so the modulo is a mask.
+class RowHasher {
+    int seed_;
+    size_t mask_;
+
+public:
+    struct Probe {
+        size_t h1;
+        size_t h2;
+    };
+
+    RowHasher(int seed, int log_num_buckets)
+        : seed_(seed)
+        , mask_((static_cast<size_t>(1) << log_num_buckets) - 1)
+    {}
+
+    Probe probe(std::string_view ngram) const { return probe(hash(ngram, seed_)); }
+
+    Probe probe(size_t h) const {
+        // h2 is odd so that the rows never collapse onto the same bucket sequence
+        return { h, static_cast<size_t>(mix_hash(h)) | 1 };
+    }
+
+    size_t bucket(const Probe& p, int row) const {
+        return (p.h1 + static_cast<size_t>(row) * p.h2) & mask_;
+    }
+};
+
+// How a classifier hashes an email, see hash_email. Classifiers with equal
+// configs get equal NgramHashes and can share them, see Ensemble.
+struct NgramConfig {
+    int ngram;
+    int seed;
+    bool dedup;
+
+    bool operator==(const NgramConfig& other) const {
+        return ngram == other.ngram && seed == other.seed && dedup == other.dedup;
+    }
+};
+
+// Hashes of the n-grams of an email, computed once so that predict and update
+// (and the perceptrons' predict inside update) work from the same buffer.
+// Every hash comes with count(j), the number of times it occurs, and the
+// classifiers scale by that count, so an email is a sparse vector of n-gram
+// counts.
+//
+// With dedup, repeated n-grams (long spam repeats its boilerplate and URLs)
+// are collapsed while hashing with a small open addressing table, so each one
+// is looked up in the classifier tables once; the hashes keep the order of
+// their first occurrence. Without it, every occurrence is its own entry with
+// count 1, and no counts are stored. The collapsing costs about as much as
+// hashing the n-gram, and the repeats of an n-gram mostly hit the cache anyway,
+// so it only pays off when the per n-gram work is heavy (the logs of exact
+// naive bayes scoring, several Count-Min rows) and the emails are repetitive.
+//
+// The buffers keep their capacity when they are refilled, and the table is
+// emptied by bumping a stamp instead of clearing it, so once they have grown
+// to the longest email seen, filling them does not allocate.
+class NgramHashes {
+    struct Slot {
+        size_t hash;
+        uint32_t stamp; // the slot is in use for the current email if this is stamp_
+        uint32_t index; // of the hash in hashes_
+    };
+
+    std::vector<size_t> hashes_;
+    std::vector<int> counts_; // filled with dedup only, every count is 1 without
+    bool dedup_ = false;
+    size_t num_ngrams_ = 0;
+    std::vector<Slot> slots_;
+    uint32_t stamp_ = 0;
+
+public:
+    // the hashes of an Email or an EmailView
+    template <typename E>
+    void fill(const E& email, int ngram, int seed, bool dedup = false) {
+        fill_from(EmailIter(email.body(), ngram), seed, dedup);
+    }
+
+    // fills every out[i] with the hashes of email under configs[i], walking the
+    // n-grams of email once; the configs must have the same n-gram size
+    template <typename E>
+    static void fill_all(const E& email, const NgramConfig* configs, NgramHashes* const* out, size_t n) {
+        if (n > 0)
+            fill_all_from(EmailIter(email.body(), configs[0].ngram), configs, out, n);
+    }
+
+    // number of entries, the distinct n-grams with dedup
+    size_t size() const { return hashes_.size(); }
+    const size_t* data() const { return hashes_.data(); }
+    std::vector<size_t>::const_iterator begin() const { return hashes_.begin(); }
+    std::vector<size_t>::const_iterator end() const { return hashes_.end(); }
+
+    // occurrences of the j-th entry
+    int count(size_t j) const { return dedup_ ? counts_[j] : 1; }
+
+    // number of n-grams of the email, repeats included
+    size_t num_ngrams() const { return num_ngrams_; }
+
+private:
+    template <typename Iter>
+    void fill_from(Iter emailiter, int seed, bool dedup) {
+        start(dedup);
+        if (dedup) {
+            while (emailiter) {
+                add(hash(emailiter.next(), seed));
+                ++num_ngrams_;
+            }
+        } else {
+            while (emailiter)
+                hashes_.push_back(hash(emailiter.next(), seed));
+            num_ngrams_ = hashes_.size();
+        }
+        BDAP_STAT_ADD(ngrams, num_ngrams_);
+        BDAP_STAT_ADD(hash_calls, num_ngrams_);
+        BDAP_STAT_ADD(distinct_ngrams, hashes_.size());
+        BDAP_STAT_RECORD(ngrams_per_email, num_ngrams_);
+    }
+
+    // several hashes per n-gram, one per distinct seed among the configs
+    template <typename Iter>
+    static void fill_all_from(Iter emailiter, const NgramConfig* configs, NgramHashes* const* out, size_t n) {
+        // first[i] is the first config with the seed of configs[i], whose hash it reuses
+        thread_local std::vector<size_t> first;
+        thread_local std::vector<size_t> h;
+        first.resize(n);
+        h.resize(n);
+        size_t num_seeds = 0;
+        for (size_t i = 0; i < n; ++i) {
+            first[i] = i;
+            for (size_t k = 0; k < i && first[i] == i; ++k) {
+                if (configs[k].seed == configs[i].seed)
+                    first[i] = k;
+            }
+            num_seeds += first[i] == i;
+            out[i]->start(configs[i].dedup);
+        }
+        size_t num_ngrams = 0;
+        while (emailiter) {
+            auto ngram = emailiter.next();
+            for (size_t i = 0; i < n; ++i) {
+                h[i] = first[i] == i ? hash(ngram, configs[i].seed) : h[first[i]];
+                out[i]->add_ngram(h[i], configs[i].dedup);
+            }
+            ++num_ngrams;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            out[i]->num_ngrams_ = num_ngrams;
+            BDAP_STAT_ADD(distinct_ngrams, out[i]->size());
+        }
+        BDAP_STAT_ADD(ngrams, num_ngrams);
+        BDAP_STAT_ADD(hash_calls, num_ngrams * num_seeds);
+        BDAP_STAT_RECORD(ngrams_per_email, num_ngrams);
+    }
+
+    void start(bool dedup) {
+        hashes_.clear();
+        counts_.clear();
+        dedup_ = dedup;
+        num_ngrams_ = 0;
+        if (dedup)
+            next_stamp();
+    }
+
+    void add_ngram(size_t h, bool dedup) {
+        if (dedup)
+            add(h);
+        else
+            hashes_.push_back(h);
+    }
+
+    void next_stamp() {
+        if (++stamp_ == 0) {
+            // the stamp wrapped, forget the stamps of earlier emails
+            for (Slot& s : slots_)
+                s.stamp = 0;
+            stamp_ = 1;
+        }
+    }
+
+    void add(size_t h) {
+        // keep the table at most half full
+        if (2 * (hashes_.size() + 1) > slots_.size())
+            grow();
+        size_t mask = slots_.size() - 1;
+        for (size_t i = h & mask;; i = (i + 1) & mask) {
+            Slot& s = slots_[i];
+            if (s.stamp != stamp_) {
+                s = {h, stamp_, static_cast<uint32_t>(hashes_.size())};
+                hashes_.push_back(h);
+                counts_.push_back(1);
+                return;
+            }
+            if (s.hash == h) {
+                ++counts_[s.index];
+                return;
+            }
+        }
+    }
+
+    // double the table and put back the hashes of the current email
+    void grow() {
+        slots_.assign(std::max<size_t>(256, 2 * slots_.size()), Slot{0, 0, 0});
+        size_t mask = slots_.size() - 1;
+        for (size_t j = 0; j < hashes_.size(); ++j) {
+            size_t i = hashes_[j] & mask;
+            while (slots_[i].stamp == stamp_)
+                i = (i + 1) & mask;
+            slots_[i] = {hashes_[j], stamp_, static_cast<uint32_t>(j)};
+        }
+    }
+};
+
+// per-thread scratch buffer used by the classifiers' predict_ and update_
+inline NgramHashes& scratch_ngram_hashes() {
+    thread_local NgramHashes hashes;
+    return hashes;
+}
+
+} // namespace bdap
@@ -0,0 +1,279 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Optional instrumentation of the classifier hot paths. Build with
+// -DBDAP_INSTRUMENT=1 to turn it on; otherwise the BDAP_STAT_* macros expand
+// to nothing and cost nothing.
+//
+// When on, every thread counts into its own block (no shared cache lines, no
+// atomic read-modify-write on the hot path) and collect_stats() sums the
+// blocks of all threads, including the ones that have exited. It counts
+// emails, n-grams walked by EmailIter (and how many of them were distinct in
+// their email), hash calls and table lookups, and keeps
+// log2 histograms of the n-grams per email and of the update/predict latency.
+//
+// The counts are process-wide, not per classifier: every classifier in the
+// process, on every thread, counts into the same totals (the hashing in
+// NgramHashes does not know its classifier). To measure one classifier, or
+// one phase, take collect_stats() before and after it and use since(), with
+// nothing else classifying in the process meanwhile.
+//
+// The state of the tables themselves (load factor, collisions) does not need
+// the hot path, see TableStats and the classifiers' table_stats().
+#ifndef BDAP_INSTRUMENT
+#define BDAP_INSTRUMENT 0
+#endif
+
+namespace bdap {
+
+// histogram with power of two buckets: counts[0] holds 0, counts[i] holds [2^(i-1), 2^i)
+struct Log2Histogram {
+    static constexpr int num_buckets = 40;
+    uint64_t counts[num_buckets] = {};
+
+    static int bucket(uint64_t x) {
+        int b = 0;
+        while (x != 0 && b < num_buckets - 1) {
+            x >>= 1;
+            ++b;
+        }
+        return b;
+    }
+
+    uint64_t total() const {
+        uint64_t n = 0;
+        for (uint64_t c : counts)
+            n += c;
+        return n;
+    }
+
+    // upper bound of the bucket that holds the p-th quantile (0 <= p <= 1)
+    double percentile(double p) const {
+        uint64_t n = total();
+        if (n == 0)
+            return 0.0;
+        uint64_t rank = static_cast<uint64_t>(std::ceil(p * n));
+        uint64_t seen = 0;
+        for (int b = 0; b < num_buckets; ++b) {
+            seen += counts[b];
+            if (seen >= rank && seen > 0)
+                return b == 0 ? 0.0 : std::ldexp(1.0, b);
+        }
+        return std::ldexp(1.0, num_buckets);
+    }
+};
+
+// Counters of the hot paths, summed over all threads and all classifiers of
+// the process, see collect_stats. The email and lookup counts are taken in
+// update_hashes and predict_hashes, so they include batched and EmailView
+// traffic. The latencies are those of update_ and predict_.
+struct ClassifierStats {
+    uint64_t emails_updated = 0;
+    uint64_t emails_predicted = 0;
+    uint64_t ngrams = 0;          // n-grams walked by EmailIter
+    uint64_t distinct_ngrams = 0; // summed per email, see NgramHashes
+    uint64_t hash_calls = 0;
+    uint64_t table_lookups = 0;   // cells read or written, one per distinct n-gram and row
+    Log2Histogram ngrams_per_email;
+    Log2Histogram update_ns;
+    Log2Histogram predict_ns;
+
+    double mean_ngrams_per_email() const {
+        uint64_t n = ngrams_per_email.total();
+        return n == 0 ? 0.0 : static_cast<double>(ngrams) / n;
+    }
+
+    // the counts since an earlier collect_stats()
+    ClassifierStats since(const ClassifierStats& earlier) const {
+        ClassifierStats d = *this;
+        d.emails_updated -= earlier.emails_updated;
+        d.emails_predicted -= earlier.emails_predicted;
+        d.ngrams -= earlier.ngrams;
+        d.distinct_ngrams -= earlier.distinct_ngrams;
+        d.hash_calls -= earlier.hash_calls;
+        d.table_lookups -= earlier.table_lookups;
+        for (int b = 0; b < Log2Histogram::num_buckets; ++b) {
+            d.ngrams_per_email.counts[b] -= earlier.ngrams_per_email.counts[b];
+            d.update_ns.counts[b] -= earlier.update_ns.counts[b];
+            d.predict_ns.counts[b] -= earlier.predict_ns.counts[b];
+        }
+        return d;
+    }
+};
+
+// Occupancy of a classifier table, computed from the table on demand.
+// The number of distinct n-grams is estimated from the empty buckets (linear
+// counting), which gives the load factor and the chance that an n-gram shares
+// its bucket with another one in every row it is hashed to.
+struct TableStats {
+    int rows = 0;
+    size_t buckets = 0;            // per row
+    double nonzero_fraction = 0.0; // buckets that were ever written
+    double load_factor = 0.0;      // estimated distinct n-grams per bucket
+    double collision_rate = 0.0;   // estimated chance that a lookup returns a shared count
+
+    // the table is too small for the traffic: more than max_collision_rate of
+    // the lookups are polluted by other n-grams, raise log_num_buckets
+    bool undersized(double max_collision_rate = 0.05) const { return collision_rate > max_collision_rate; }
+};
+
+inline TableStats make_table_stats(int rows, size_t buckets, size_t nonzero) {
+    TableStats s;
+    s.rows = rows;
+    s.buckets = buckets;
+    size_t cells = static_cast<size_t>(rows) * buckets;
+    if (cells == 0)
+        return s;
+    s.nonzero_fraction = static_cast<double>(nonzero) / cells;
+    // a full table only tells that there are at least as many n-grams as buckets
+    double empty = std::max(1.0 - s.nonzero_fraction, 1.0 / cells);
+    s.load_factor = -std::log(empty);
+    s.collision_rate = std::pow(1.0 - std::exp(-s.load_factor), rows);
+    return s;
+}
+
+namespace detail {
+
+// written by one thread only, so a relaxed load and store is enough and other
+// threads can read it while it runs
+struct StatCounter {
+    std::atomic<uint64_t> v{0};
+    void add(uint64_t n) { v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    uint64_t get() const { return v.load(std::memory_order_relaxed); }
+};
+
+struct StatHistogram {
+    StatCounter counts[Log2Histogram::num_buckets];
+    void record(uint64_t x) { counts[Log2Histogram::bucket(x)].add(1); }
+    void add_to(Log2Histogram& h) const {
+        for (int b = 0; b < Log2Histogram::num_buckets; ++b)
+            h.counts[b] += counts[b].get();
+    }
+};
+
+struct ThreadStats {
+    StatCounter emails_updated;
+    StatCounter emails_predicted;
+    StatCounter ngrams;
+    StatCounter distinct_ngrams;
+    StatCounter hash_calls;
+    StatCounter table_lookups;
+    StatHistogram ngrams_per_email;
+    StatHistogram update_ns;
+    StatHistogram predict_ns;
+    int nested = 0; // > 0 while an Ensemble runs its members, see BDAP_STAT_NESTED
+
+    void add_to(ClassifierStats& s) const {
+        s.emails_updated += emails_updated.get();
+        s.emails_predicted += emails_predicted.get();
+        s.ngrams += ngrams.get();
+        s.distinct_ngrams += distinct_ngrams.get();
+        s.hash_calls += hash_calls.get();
+        s.table_lookups += table_lookups.get();
+        ngrams_per_email.add_to(s.ngrams_per_email);
+        update_ns.add_to(s.update_ns);
+        predict_ns.add_to(s.predict_ns);
+    }
+};
+
+struct StatsRegistry {
+    std::mutex mutex;
+    std::vector<const ThreadStats*> live;
+    ClassifierStats retired; // threads that have exited
+};
+
+inline StatsRegistry& stats_registry() {
+    static StatsRegistry registry;
+    return registry;
+}
+
+// the block of the calling thread, registered on first use and folded into
+// the retired counts when the thread exits
+class ThreadStatsHandle {
+    ThreadStats stats_;
+
+public:
+    ThreadStatsHandle() {
+        StatsRegistry& r = stats_registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.live.push_back(&stats_);
+    }
+
+    ~ThreadStatsHandle() {
+        StatsRegistry& r = stats_registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        stats_.add_to(r.retired);
+        r.live.erase(std::find(r.live.begin(), r.live.end(), &stats_));
+    }
+
+    ThreadStats& stats() { return stats_; }
+};
+
+inline ThreadStats& thread_stats() {
+    thread_local ThreadStatsHandle handle;
+    return handle.stats();
+}
+
+// the emails of the calling thread's classifier calls are counted by the
+// outermost one only while this lives
+class ScopedStatNesting {
+    ThreadStats& stats_;
+
+public:
+    ScopedStatNesting() : stats_(thread_stats()) { ++stats_.nested; }
+    ~ScopedStatNesting() { --stats_.nested; }
+};
+
+// records the time from construction to destruction in a histogram
+class ScopedStatTimer {
+    StatHistogram& histogram_;
+    std::chrono::steady_clock::time_point start_;
+
+public:
+    explicit ScopedStatTimer(StatHistogram& histogram)
+        : histogram_(histogram), start_(std::chrono::steady_clock::now()) {}
+    ~ScopedStatTimer() {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_);
+        histogram_.record(static_cast<uint64_t>(ns.count()));
+    }
+};
+
+} // namespace detail
+
+// the counts of all threads and classifiers of the process so far; all zero
+// unless built with BDAP_INSTRUMENT
+inline ClassifierStats collect_stats() {
+    detail::StatsRegistry& r = detail::stats_registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    ClassifierStats s = r.retired;
+    for (const detail::ThreadStats* t : r.live)
+        t->add_to(s);
+    return s;
+}
+
+} // namespace bdap
+
+#if BDAP_INSTRUMENT
+#define BDAP_STAT_ADD(counter, n) (::bdap::detail::thread_stats().counter.add(n))
+#define BDAP_STAT_RECORD(histogram, x) (::bdap::detail::thread_stats().histogram.record(x))
+// one email for counter, unless a BDAP_STAT_NESTED caller has counted it
+#define BDAP_STAT_EMAIL(counter) \
+    (::bdap::detail::thread_stats().nested == 0 ? ::bdap::detail::thread_stats().counter.add(1) : (void)0)
+#define BDAP_STAT_NESTED() ::bdap::detail::ScopedStatNesting bdap_stat_nesting_
+#define BDAP_STAT_TIMER(histogram) \
+    ::bdap::detail::ScopedStatTimer bdap_stat_timer_(::bdap::detail::thread_stats().histogram)
+#else
+#define BDAP_STAT_ADD(counter, n) ((void)0)
+#define BDAP_STAT_RECORD(histogram, x) ((void)0)
+#define BDAP_STAT_EMAIL(counter) ((void)0)
+#define BDAP_STAT_NESTED() ((void)0)
+#define BDAP_STAT_TIMER(histogram) ((void)0)
+#endif
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+
+namespace bdap {
+
+// log(c + 1) for a non-negative count c. Most sketch cells hold small counts,
+// so those are looked up in a precomputed table instead of calling log.
+inline double log_count_plus_one(long long c) {
+    constexpr int table_size = 1 << 12; // 32KB, stays in L1/L2
+    static const std::vector<double> table = [] {
+        std::vector<double> t(table_size);
+        for (int i = 0; i < table_size; ++i)
+            t[i] = std::log(static_cast<double>(i) + 1.0);
+        return t;
+    }();
+    if (c >= 0 && c < table_size)
+        return table[c];
+    return std::log(static_cast<double>(c) + 1.0);
+}
+
+} // namespace bdap
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace bdap {
+
+// read-only memory mapping of a whole file, unmapped when destroyed; an empty
+// file gives an empty mapping (data() is null)
+class MappedFile {
+    void* addr_ = nullptr;
+    size_t size_ = 0;
+
+public:
+    explicit MappedFile(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("cannot open file: " + path);
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw std::runtime_error("cannot stat file: " + path);
+        }
+        size_ = static_cast<size_t>(st.st_size);
+        if (size_ == 0) { // mmap rejects a length of 0
+            ::close(fd);
+            return;
+        }
+        addr_ = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (addr_ == MAP_FAILED)
+            throw std::runtime_error("cannot map file: " + path);
+    }
+
+    ~MappedFile() {
+        if (addr_ != nullptr)
+            ::munmap(addr_, size_);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return static_cast<const char*>(addr_); }
+    size_t size() const { return size_; }
+
+    // madvise over [offset, offset + length), e.g. MADV_WILLNEED to start reading
+    // pages in ahead of use; only a hint, errors are ignored
+    void advise(size_t offset, size_t length, int advice) const {
+        if (offset >= size_)
+            return;
+        size_t page = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+        size_t begin = offset / page * page;
+        size_t end = std::min(offset + length, size_);
+        ::madvise(const_cast<char*>(data()) + begin, end - begin, advice);
+    }
+};
+
+} // namespace bdap
@@ -1,10 +1,21 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
 #include "email.hpp"
+#include "parallel.hpp"
 
 namespace bdap {
 
-    struct Accuracy {
-        int n = 0;
-        int correct = 0;
+    // Counts TP/FP/TN/FN, scoring every email once. The metrics below all
+    // derive from it, so one evaluation can report all of them.
+    struct ConfusionMatrix {
+        // long long, a prequential run (see prequential.hpp) can see billions of emails
+        long long true_pos = 0;
+        long long false_pos = 0;
+        long long true_neg = 0;
+        long long false_neg = 0;
 
         template <typename Clf>
         void evaluate(const Clf& clf, const std::vector<Email>& emails)
@@ -15,129 +26,182 @@ namespace bdap {
 
         template <typename Clf>
         void evaluate(const Clf& clf, const Email& email) {
-            bool lab = email.is_spam();
             double pr = clf.predict(email);
-            bool pred = clf.classify(pr);
-            ++n;
-            correct += static_cast<int>(lab == pred);
+            add(email.is_spam(), clf.classify(pr));
         }
 
-        double get_accuracy() const { return static_cast<double>(correct) / n; }
-        double get_error() const { return 1.0 - get_accuracy(); }
-
-        double get_score() const { return get_accuracy(); }
-    };
-
-    // TODO add your own metrics below here
-
-     struct Recall {
-        int true_pos = 0;
-        int false_neg = 0;
-
+        // same result as evaluate(clf, emails), but the emails are scored on num_threads
+        // threads (0 = one per core). predict is const, so the workers share clf; each one
+        // counts into its own matrix and the matrices are merged at the end.
         template <typename Clf>
-        void evaluate(const Clf& clf, const std::vector<Email>& emails)
+        void evaluate_parallel(const Clf& clf, const std::vector<Email>& emails, int num_threads = 0)
         {
-            for (const Email& email : emails)
-                evaluate(clf, email);
+            if (num_threads <= 0)
+                num_threads = default_num_threads();
+            std::vector<ConfusionMatrix> partial(num_threads);
+            parallel_chunks(emails.size(), num_threads, [&](int worker, size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i)
+                    partial[worker].evaluate(clf, emails[i]);
+            });
+            for (const ConfusionMatrix& m : partial)
+                merge(m);
         }
 
+        // scores[i] is clf.predict(emails[i]), computed once beforehand (see score_emails)
         template <typename Clf>
-        void evaluate(const Clf& clf, const Email& email) {
-            bool lab = email.is_spam();
-            double pr = clf.predict(email);
-            bool pred = clf.classify(pr);
-                
-            if (lab && pred)
-                ++true_pos;
-            else if(lab && !pred)
-                ++false_neg;
+        void evaluate_scores(const Clf& clf, const std::vector<double>& scores,
+                             const std::vector<Email>& emails)
+        {
+            for (size_t i = 0; i < emails.size(); ++i)
+                add(emails[i].is_spam(), clf.classify(scores[i]));
         }
-                
-        double get_recall() const { return (true_pos + 0.0) / (true_pos + false_neg); }
-        double get_error() const { return 1.0 - get_recall(); }
-
-        double get_score() const { return get_recall(); }
-    };
-
-     struct Precision {
-        int true_pos = 0;
-        int false_pos = 0;
 
-        template <typename Clf>
-        void evaluate(const Clf& clf, const std::vector<Email>& emails)
+        // same, but with an explicit threshold: a score above it is classified as spam
+        void evaluate_scores(const std::vector<double>& scores, const std::vector<Email>& emails,
+                             double threshold)
         {
-            for (const Email& email : emails)
-                evaluate(clf, email);
+            for (size_t i = 0; i < emails.size(); ++i)
+                add(emails[i].is_spam(), scores[i] > threshold);
         }
 
-        template <typename Clf>
-        void evaluate(const Clf& clf, const Email& email) {
-            bool lab = email.is_spam();
-            double pr = clf.predict(email);
-            bool pred = clf.classify(pr);
-                
+        void add(bool lab, bool pred) {
             if (lab && pred)
                 ++true_pos;
-            else if(!lab && pred)
+            else if (!lab && pred)
                 ++false_pos;
+            else if (!lab && !pred)
+                ++true_neg;
+            else
+                ++false_neg;
         }
-                
-        double get_precision() const { return (true_pos + 0.0)/ (true_pos + false_pos); }
-        double get_error() const { return 1.0 - get_precision(); }
 
-        double get_score() const { return get_precision(); }
+        void merge(const ConfusionMatrix& other) {
+            true_pos += other.true_pos;
+            false_pos += other.false_pos;
+            true_neg += other.true_neg;
+            false_neg += other.false_neg;
+        }
+
+        long long get_n() const { return true_pos + false_pos + true_neg + false_neg; }
+
+        double get_accuracy() const { return (true_pos + true_neg + 0.0) / get_n(); }
+        double get_recall() const { return (true_pos + 0.0) / (true_pos + false_neg); }
+        double get_precision() const { return (true_pos + 0.0) / (true_pos + false_pos); }
+        double get_F1Score() const {
+            double precision = get_precision();
+            double recall = get_recall();
+            return (2 * precision * recall) / (precision + recall);
+        }
     };
 
-    struct F1Score {
-        int true_pos = 0;
-        int false_neg = 0;
-        int false_pos = 0;
+    // score every email once, so the scores can be fed to any number of metrics and thresholds
+    template <typename Clf>
+    std::vector<double> score_emails(const Clf& clf, const std::vector<Email>& emails)
+    {
+        std::vector<double> scores;
+        scores.reserve(emails.size());
+        for (const Email& email : emails)
+            scores.push_back(clf.predict(email));
+        return scores;
+    }
+
+    // Confusion matrix of only the last window emails. Keeps the outcome of each of
+    // them in a ring, so memory is fixed by the window and not by the stream length.
+    class SlidingConfusionMatrix {
+        ConfusionMatrix counts_;
+        std::vector<uint8_t> outcomes_; // 2 * label + prediction
+        size_t next_ = 0;
+        bool full_ = false;
+
+    public:
+        explicit SlidingConfusionMatrix(size_t window) : outcomes_(window == 0 ? 1 : window) {}
+
+        void add(bool lab, bool pred) {
+            if (full_)
+                forget(outcomes_[next_]);
+            outcomes_[next_] = static_cast<uint8_t>(2 * lab + pred);
+            counts_.add(lab, pred);
+            if (++next_ == outcomes_.size()) {
+                next_ = 0;
+                full_ = true;
+            }
+        }
 
-        template <typename Clf>
-        void evaluate(const Clf& clf, const std::vector<Email>& emails)
-        {
-            for (const Email& email : emails)
-                evaluate(clf, email);
+        const ConfusionMatrix& counts() const { return counts_; }
+        size_t window() const { return outcomes_.size(); }
+
+    private:
+        void forget(uint8_t outcome) {
+            switch (outcome) {
+            case 3: --counts_.true_pos; break;
+            case 1: --counts_.false_pos; break;
+            case 0: --counts_.true_neg; break;
+            default: --counts_.false_neg; break;
+            }
         }
+    };
 
-        template <typename Clf>
-        void evaluate(const Clf& clf, const Email& email) {
-            bool lab = email.is_spam();
-            double pr = clf.predict(email);
-            bool pred = clf.classify(pr);
-                
+    // Confusion matrix where every earlier email weighs alpha times less than the
+    // next one (0 < alpha < 1), so old mistakes fade out. Roughly a window of
+    // 1 / (1 - alpha) emails, in constant memory.
+    struct FadingConfusionMatrix {
+        double alpha;
+        double true_pos = 0;
+        double false_pos = 0;
+        double true_neg = 0;
+        double false_neg = 0;
+
+        explicit FadingConfusionMatrix(double alpha) : alpha(alpha) {}
+
+        void add(bool lab, bool pred) {
+            true_pos *= alpha;
+            false_pos *= alpha;
+            true_neg *= alpha;
+            false_neg *= alpha;
             if (lab && pred)
                 ++true_pos;
-            else if(!lab && pred)
+            else if (!lab && pred)
                 ++false_pos;
-            else if(lab && !pred)
+            else if (!lab && !pred)
+                ++true_neg;
+            else
                 ++false_neg;
         }
-                
-        //double get_precision() const { return (true_pos + 0.0) / (true_pos + false_pos); }
-        //double get_recall() const { return (true_pos + 0.0)/ (true_pos + false_neg); }
-        //double precision = get_precision();
-        //double recall = get_recall();
-        double get_F1Score() const { return (2*((true_pos + 0.0) / (true_pos + false_pos))*((true_pos + 0.0)/ (true_pos + false_neg))) / (((true_pos + 0.0) / (true_pos + false_pos)) + ((true_pos + 0.0)/ (true_pos + false_neg))); }
-        double get_error() const { return 1.0 - get_F1Score(); }
 
-        double get_score() const { return get_F1Score(); }
+        double get_n() const { return true_pos + false_pos + true_neg + false_neg; }
+
+        double get_accuracy() const { return (true_pos + true_neg) / get_n(); }
+        double get_recall() const { return true_pos / (true_pos + false_neg); }
+        double get_precision() const { return true_pos / (true_pos + false_pos); }
+        double get_F1Score() const {
+            double precision = get_precision();
+            double recall = get_recall();
+            return (2 * precision * recall) / (precision + recall);
+        }
     };
 
-    struct ConfusionMatrix {
+    struct Accuracy : ConfusionMatrix {
+        double get_error() const { return 1.0 - get_accuracy(); }
 
-        template <typename Clf>
-        void evaluate(const Clf& clf, const std::vector<Email>& emails)
-        {
-            for (const Email& email : emails)
-                evaluate(clf, email);
-        }
+        double get_score() const { return get_accuracy(); }
+    };
 
-        template <typename Clf>
-        void evaluate(const Clf& clf, Email& emails) {
+    struct Recall : ConfusionMatrix {
+        double get_error() const { return 1.0 - get_recall(); }
 
-        }
+        double get_score() const { return get_recall(); }
+    };
+
+    struct Precision : ConfusionMatrix {
+        double get_error() const { return 1.0 - get_precision(); }
 
+        double get_score() const { return get_precision(); }
+    };
+
+    struct F1Score : ConfusionMatrix {
+        double get_error() const { return 1.0 - get_F1Score(); }
+
+        double get_score() const { return get_F1Score(); }
     };
 
 
@@ -1,83 +1,259 @@
 #pragma once
 
+#include <algorithm>
 #include <cmath>
 #include <iostream>
 #include <limits>
+#include <stdexcept>
+#include <string>
 #include <string_view>
+#include <type_traits>
 #include <vector>
 #include "email.hpp"
 #include "base_classifier.hpp"
+#include "count_min_sketch.hpp"
+#include "counters.hpp"
+#include "hashing.hpp"
+#include "instrumentation.hpp"
+#include "log_table.hpp"
+#include "snapshot.hpp"
+#include "sketch_kernels.hpp"
 
 namespace bdap {
 
-class NaiveBayesCountMin : public BaseClf<NaiveBayesCountMin> {
+// Count is the type of the sketch cells, see counters.hpp. Rows != 0 fixes
+// num_hashes at compile time so the loops over the rows are unrolled, see
+// dispatch.hpp; Rows = 0 takes it at runtime.
+template <typename Count = int, int Rows = 0>
+class BasicNaiveBayesCountMin : public BaseClf<BasicNaiveBayesCountMin<Count, Rows>> {
     int ngram_;
     int seed_;
     int num_spam=0;
     int num_ham=0;
     int num_hashes_;
     int log_num_buckets_;
-    std::vector<std::vector<int>> cms_spam_;
-    std::vector<std::vector<int>> cms_ham_;
+    CountMinSketch<Count> cms_; // first = spam count, second = ham count of the same bucket
+    long long total_spam_=0; // sum of all spam cells of cms_, kept up to date in update_
+    long long total_ham_=0;
+    RowHasher hasher_;
+    bool frozen_=false;
+    bool dedup_=false; // see set_dedup
+
+    // decay, see set_decay
+    size_t decay_epoch_=0; // 0 = no decay
+    double decay_factor_=1.0;
+    size_t decay_cursor_=0; // the next cell the running decay rescales
+    SketchUpdate update_policy_=SketchUpdate::Standard;
+    SketchQuery query_policy_=SketchQuery::Min;
+    size_t prefetch_distance_=0; // see set_prefetch_distance
 
 public:
-    NaiveBayesCountMin(int ngram, int num_hashes, int log_num_buckets)
-        : BaseClf(-4 /* set appropriate threshold */)
+    BasicNaiveBayesCountMin(int ngram, int num_hashes, int log_num_buckets)
+        : BaseClf<BasicNaiveBayesCountMin>(-4 /* set appropriate threshold */)
         , ngram_(ngram)
         , seed_(0xfa4f8cc)
         , num_hashes_(num_hashes)
         , log_num_buckets_(log_num_buckets)
+        , cms_(num_hashes, log_num_buckets) // one cms matrix for both classes, initialized to 0
+        , hasher_(seed_, log_num_buckets)
     {
-        size_t num_buckets_ = 1 << log_num_buckets_;
-        
-        // create different cms matrixes for spam and ham classes and initialize to 0
-        cms_spam_.resize(num_hashes_);
-        cms_ham_.resize(num_hashes_);
-
-        for (int i=0; i<num_hashes_; ++i){
-            cms_spam_[i].resize(num_buckets_,0);
-            cms_ham_[i].resize(num_buckets_,0);
-        }
+        if (Rows != 0 && num_hashes != Rows)
+            throw std::invalid_argument("NaiveBayesCountMin: num_hashes does not match the Rows template argument");
+    }
 
+    template <typename E>
+    void update_(const E& email) {
+        BDAP_STAT_TIMER(update_ns);
+        // TODO implement this
+        //hash the n-grams once into the per-thread buffer
+        NgramHashes& hashes = scratch_ngram_hashes();
+        hash_email(email, hashes);
+        update_hashes(hashes, email.is_spam());
     }
 
-    void update_(const Email &email) {
+    template <typename E>
+    double predict_(const E& email) const {
+        BDAP_STAT_TIMER(predict_ns);
         // TODO implement this
-        //create an instance of the EmailIter class with n-gram size
-        EmailIter emailiter(email, ngram_);
-        // get the number of buckets from their logarithmic representation using bit manipulation
-        size_t num_buckets_ = 1 << log_num_buckets_;
+        NgramHashes& hashes = scratch_ngram_hashes();
+        hash_email(email, hashes);
+        return predict_hashes(hashes);
+    }
+
+    // fill hashes with the n-gram hashes of email (an Email or an EmailView), as used by
+    // update_hashes and predict_hashes
+    template <typename E>
+    void hash_email(const E& email, NgramHashes& hashes) const {
+        hashes.fill(email, ngram_, seed_, dedup_);
+    }
+
+    // Collapse repeated n-grams before the lookups, see NaiveBayesFeatureHashing::set_dedup.
+    // The conservative update then applies the occurrences of an email grouped by
+    // n-gram, so n-grams that share a cell can end up with slightly different counts.
+    void set_dedup(bool dedup) { dedup_ = dedup; }
+
+    // see NaiveBayesFeatureHashing::set_table_memory
+    void set_table_memory(const TableMemory& memory) { cms_.set_memory(memory); }
+
+    // how hash_email hashes an email
+    NgramConfig ngram_config() const { return {ngram_, seed_, dedup_}; }
 
+    void update_hashes(const NgramHashes& hashes, bool is_spam) {
+        BDAP_STAT_EMAIL(emails_updated);
+        BDAP_STAT_ADD(table_lookups, hashes.size() * rows());
         //calculate the spam/ham emails
-         if(email.is_spam()){
+         if(is_spam){
             num_spam++;
-            updateCountMinSketch(cms_spam_ , emailiter, num_buckets_);
+            updateCountMinSketch(&Cell::first, total_spam_, hashes);
         } else{
             num_ham++;
-            updateCountMinSketch(cms_ham_ , emailiter, num_buckets_);
+            updateCountMinSketch(&Cell::second, total_ham_, hashes);
         }
 
+        if (decay_epoch_ != 0)
+            decay_slice();
     }
-       
 
-    double predict_(const Email& email) const {
-        // TODO implement this
-        int total_spam=0;
-        int total_ham=0;
+    // Exponential forgetting, see NaiveBayesFeatureHashing::set_decay: every cell and
+    // the class counts are multiplied by factor once per epoch updates, a slice of the
+    // sketch per update. epoch 0 turns it off.
+    void set_decay(size_t epoch, double factor) {
+        decay_epoch_ = epoch;
+        decay_factor_ = factor;
+        decay_cursor_ = 0;
+    }
+
+    // multiply everything seen so far by factor now; integer counts are rounded down
+    void decay(double factor) {
+        decay_class_counts(factor);
+        scale_cells(0, cms_.size(), factor);
+    }
+
+    // Frozen scoring: look up log(count + 1) in a table for small counts and take the
+    // log of the class totals once per email instead of once per n-gram. The min over
+    // the rows rules out a per-bucket table, this removes the logs instead. Scores can
+    // differ from the exact ones in the last digits.
+    void set_frozen_scoring(bool frozen) { frozen_ = frozen; }
+
+    // Sketch policies, see count_min_sketch.hpp. Conservative update and count-mean-min
+    // both cut the collision error, so fewer rows and buckets reach the same precision.
+    // The class totals are the sums of the cells under every policy, so the conservative
+    // update also lowers the denominators. Count-mean-min assumes every row received every
+    // occurrence, so it goes with the standard update.
+    // The policies are not stored in snapshots, set them again after load.
+    void set_sketch_policy(SketchUpdate update, SketchQuery query) {
+        update_policy_ = update;
+        query_policy_ = query;
+    }
+
+    // Prefetch the cells of the n-grams distance ahead of the block being looked up,
+    // and in update_batch and predict_batch those of the first distance n-grams of the
+    // next email, see batch.hpp. 0 turns it off.
+    void set_prefetch_distance(size_t distance) { prefetch_distance_ = distance; }
+
+    // start loading the cells of the n-grams [begin, end) of hashes into the cache
+    void prefetch_ngrams(const NgramHashes& hashes, size_t begin, size_t end) const {
+        for (size_t j = begin; j < std::min(end, hashes.size()); ++j) {
+            RowHasher::Probe probe = hasher_.probe(hashes.data()[j]);
+            for (int i = 0; i < rows(); ++i)
+                __builtin_prefetch(&cms_.at(i, hasher_.bucket(probe, i)));
+        }
+    }
+
+    template <typename E>
+    void update_batch_(const E* emails, size_t n) {
+        prefetched_update_batch(*this, emails, n, prefetch_distance_);
+    }
+
+    template <typename E>
+    void predict_batch_(const E* emails, size_t n, double* scores) const {
+        prefetched_predict_batch(*this, emails, n, scores, prefetch_distance_);
+    }
+
+    // add the counts of a model trained on another part of the stream (another thread or
+    // node); the result is the model trained on both parts only if merges_exactly()
+    void merge(const BasicNaiveBayesCountMin& other) {
+        if (ngram_ != other.ngram_ || seed_ != other.seed_ || !cms_.same_shape(other.cms_))
+            throw std::invalid_argument("NaiveBayesCountMin::merge: models have different parameters");
+        num_spam += other.num_spam;
+        num_ham += other.num_ham;
+        total_spam_ += other.total_spam_;
+        total_ham_ += other.total_ham_;
+        cms_.add(other.cms_);
+    }
+
+    // whether the counts of an email do not depend on the emails before it, so models
+    // trained on parts of a stream merge into the model trained on all of it: not under
+    // the conservative update or decay, nor with saturating or Morris cells
+    bool merges_exactly() const {
+        return std::is_arithmetic<Count>::value && update_policy_ == SketchUpdate::Standard && decay_epoch_ == 0;
+    }
+
+    // forget everything seen so far, keep the parameters
+    void clear() {
+        num_spam = 0;
+        num_ham = 0;
+        total_spam_ = 0;
+        total_ham_ = 0;
+        cms_.clear();
+    }
+
+    // write the model to a snapshot file, see snapshot.hpp
+    void save(const std::string& path) const {
+        SnapshotWriter writer(make_snapshot_header(SnapshotKind::NaiveBayesCountMin));
+        SnapshotHeader& header = writer.header();
+        header.ngram = ngram_;
+        header.num_hashes = num_hashes_;
+        header.log_num_buckets = log_num_buckets_;
+        header.seed = seed_;
+        header.cell_types = cell_types_code<Count, Count>();
+        header.num_spam = num_spam;
+        header.num_ham = num_ham;
+        header.total_spam = total_spam_;
+        header.total_ham = total_ham_;
+        header.decay_epoch = decay_epoch_;
+        header.decay_factor = decay_factor_;
+        header.decay_cursor = decay_cursor_;
+        writer.add_table(cms_.cells());
+        writer.write(path);
+    }
+
+    // map a snapshot written by save, the model then scores straight from the mapped file
+    static BasicNaiveBayesCountMin load(const std::string& path) {
+        return BasicNaiveBayesCountMin(SnapshotReader(path, SnapshotKind::NaiveBayesCountMin,
+                                                      cell_types_code<Count, Count>()));
+    }
+
+    // bytes held by the sketch
+    size_t memory_bytes() const { return cms_.size() * sizeof(Cell); }
+
+    // occupancy of the sketch, see instrumentation.hpp
+    TableStats table_stats() const {
+        size_t nonzero = 0;
+        const Cell* cells = cms_.data();
+        for (size_t c = 0; c < cms_.size(); ++c)
+            nonzero += count_value(cells[c].first) != 0 || count_value(cells[c].second) != 0;
+        return make_table_stats(num_hashes_, cms_.num_buckets(), nonzero);
+    }
 
+    double predict_hashes(const NgramHashes& hashes) const {
+        BDAP_STAT_EMAIL(emails_predicted);
+        BDAP_STAT_ADD(table_lookups, hashes.size() * rows());
         //calculate P(S) and P(H)
 
         double log_prob_spam = log(static_cast<double>(num_spam)/(num_spam+num_ham));
         double log_prob_ham = log(static_cast<double>(num_ham)/(num_spam+num_ham));
 
-        //calculate total count of ngrams in each class 
-        total_spam=calculateTotalCount(cms_spam_);
-        total_ham=calculateTotalCount(cms_ham_);
-
-
         //calculate the log-likelihood of each n-gram occurrence given spam or ham class
-        double log_likelihood_spam = calculateLogLikelihood(email, cms_spam_);
-        double log_likelihood_ham = calculateLogLikelihood(email, cms_ham_);
+        //the total count of ngrams in each class is maintained by update_, so this only depends on the email length
+        double log_likelihood_spam = 0.0;
+        double log_likelihood_ham = 0.0;
+        calculateLogLikelihood(hashes, log_likelihood_spam, log_likelihood_ham);
+        if (frozen_) {
+            // the denominators were left out per n-gram
+            log_likelihood_spam -= hashes.num_ngrams() * log_count_plus_one(total_spam_);
+            log_likelihood_ham -= hashes.num_ngrams() * log_count_plus_one(total_ham_);
+        }
 
         //calculate P(S|text)
         double overall_prob= log_likelihood_spam +log_prob_spam - log_likelihood_ham - log_prob_ham;
@@ -86,57 +262,156 @@ public:
     }
 
 private:
-    // function to update the Count-Min Sketch matrix
-    void updateCountMinSketch(std::vector<std::vector<int>>& cms, EmailIter& emailiter, size_t num_buckets) {
-        while (emailiter) {
-            std::string_view ngram = emailiter.next(); // iterate through the n grams and extract one at a time
-
-            // each n-gram is hashed num_hashes_ different times
-            for (int i = 0; i < num_hashes_; ++i) {
-                size_t bucket = hash(ngram, seed_ + i) % num_buckets; // use % num_buckets to prevent overflow
-                cms[i][bucket] += 1; 
-            }
+    using Cell = typename CountMinSketch<Count>::Cell;
+
+    explicit BasicNaiveBayesCountMin(const SnapshotReader& snapshot)
+        : BaseClf<BasicNaiveBayesCountMin>(-4 /* same threshold as the public constructor */)
+        , ngram_(snapshot.header().ngram)
+        , seed_(snapshot.header().seed)
+        , num_spam(static_cast<int>(snapshot.header().num_spam))
+        , num_ham(static_cast<int>(snapshot.header().num_ham))
+        , num_hashes_(snapshot.header().num_hashes)
+        , log_num_buckets_(snapshot.header().log_num_buckets)
+        , cms_(num_hashes_, log_num_buckets_, snapshot.template table<Cell>(0))
+        , total_spam_(snapshot.header().total_spam)
+        , total_ham_(snapshot.header().total_ham)
+        , hasher_(seed_, log_num_buckets_)
+        , decay_epoch_(snapshot.header().decay_epoch)
+        , decay_factor_(snapshot.header().decay_factor)
+        , decay_cursor_(snapshot.header().decay_cursor)
+    {
+        if (cms_.size() != static_cast<size_t>(num_hashes_) << log_num_buckets_ || decay_cursor_ > cms_.size())
+            throw std::runtime_error("corrupt NaiveBayesCountMin snapshot");
+        if (Rows != 0 && num_hashes_ != Rows)
+            throw std::runtime_error("NaiveBayesCountMin snapshot has a different number of rows");
+    }
+
+    // Rescales the next cms_.size() / decay_epoch_ cells, so that no update waits on
+    // a rewrite of the whole sketch; the class counts go at the end of every sweep.
+    void decay_slice() {
+        size_t slice = (cms_.size() + decay_epoch_ - 1) / decay_epoch_;
+        size_t end = std::min(decay_cursor_ + slice, cms_.size());
+        scale_cells(decay_cursor_, end, decay_factor_);
+        decay_cursor_ = end;
+        if (decay_cursor_ == cms_.size()) {
+            decay_cursor_ = 0;
+            decay_class_counts(decay_factor_);
         }
     }
 
-    int calculateTotalCount(const std::vector<std::vector<int>>& cms) const {
-        int total_count = 0;
+    // the totals change by what the rounding left of the cells, so they stay their sums
+    void scale_cells(size_t begin, size_t end, double factor) {
+        long long spam_delta = 0;
+        long long ham_delta = 0;
+        cms_.scale(factor, begin, end, spam_delta, ham_delta);
+        total_spam_ += spam_delta;
+        total_ham_ += ham_delta;
+    }
+
+    // a class that was seen keeps a count of at least 1, so its prior stays finite
+    void decay_class_counts(double factor) {
+        num_spam = num_spam > 0 ? std::max(1, static_cast<int>(std::lround(num_spam * factor))) : 0;
+        num_ham = num_ham > 0 ? std::max(1, static_cast<int>(std::lround(num_ham * factor))) : 0;
+    }
+
+    // num_hashes_, known at compile time when Rows != 0
+    int rows() const { return Rows != 0 ? Rows : num_hashes_; }
 
-        // Iterate through all buckets in the Count-Min Sketch matrix
-        for (const auto& row : cms) {
-            for (int count : row) {
-                total_count += count;
+    // function to update the Count-Min Sketch matrix
+    // cls selects the spam or ham count of a cell, total is the running sum of those counts
+    void updateCountMinSketch(Count Cell::* cls, long long& total, const NgramHashes& hashes) {
+        for (size_t j = 0; j < hashes.size(); ++j) {
+            // each n-gram is hashed once, the bucket of every row is derived from that hash
+            if (prefetch_distance_ != 0 && j % kernels::block_size == 0)
+                prefetch_ngrams(hashes, j + prefetch_distance_, j + prefetch_distance_ + kernels::block_size);
+            RowHasher::Probe probe = hasher_.probe(hashes.data()[j]);
+            int count = hashes.count(j); // occurrences of the n-gram in the email
+            if (update_policy_ == SketchUpdate::Conservative) {
+                // only the rows at the current minimum are raised, one occurrence at a time
+                for (int k = 0; k < count; ++k) {
+                    long long min_count = std::numeric_limits<long long>::max();
+                    for (int i = 0; i < rows(); ++i)
+                        min_count = std::min(min_count, static_cast<long long>(count_value(cms_.at(i, hasher_.bucket(probe, i)).*cls)));
+                    // total grows by the raises made, so it stays the sum of the cells
+                    for (int i = 0; i < rows(); ++i) {
+                        Count& c = cms_.at(i, hasher_.bucket(probe, i)).*cls;
+                        if (count_value(c) == min_count)
+                            total += increment_delta(c, 1);
+                    }
+                }
+            } else {
+                // a saturated cell does not grow, nor does total for it
+                for (int i = 0; i < rows(); ++i) {
+                    total += increment_delta(cms_.at(i, hasher_.bucket(probe, i)).*cls, count);
+                }
             }
         }
-
-        return total_count;
     }
 
-    double calculateLogLikelihood(const Email& email, const std::vector<std::vector<int>>& cms) const {
-        double log_likelihood = 0.0;
+    // spam and ham counts of a bucket share a cell, so both likelihoods are computed in one pass
+    void calculateLogLikelihood(const NgramHashes& hashes, double& log_likelihood_spam, double& log_likelihood_ham) const {
+        if (query_policy_ == SketchQuery::CountMeanMin) {
+            calculateLogLikelihoodCountMeanMin(hashes, log_likelihood_spam, log_likelihood_ham);
+            return;
+        }
 
         //calculate the log-likelihood of each n-gram occurrence given spam or ham
-        EmailIter emailiter(email, ngram_); 
-        while (emailiter) {
-            std::string_view ngram = emailiter.next();
-            size_t num_buckets_ = 1 << log_num_buckets_;
-            std::vector<int> counts;
-
-             // Iterate through hash functions and get the counts for the ngram
-             for (int i = 0; i < num_hashes_; ++i) {
-                size_t bucket = hash(ngram, seed_ + i) % num_buckets_;
-                counts.push_back(cms[i][bucket]);
-            }
+        //the minimum of the counts over the hash functions is computed a block of n-grams at a time
+        int min_spam[kernels::block_size];
+        int min_ham[kernels::block_size];
+        for (size_t j = 0; j < hashes.size(); j += kernels::block_size) {
+            size_t n = std::min(kernels::block_size, hashes.size() - j);
+            if (prefetch_distance_ != 0)
+                prefetch_ngrams(hashes, j + prefetch_distance_, j + prefetch_distance_ + n);
+            kernels::min_rows<Rows>(cms_, hasher_, hashes.data() + j, n, min_spam, min_ham);
 
-            // get the minimum of the counts
-            int min_count = *std::min_element(counts.begin(), counts.end());
+            // every distinct n-gram counts as often as it occurs
+            if (frozen_) {
+                for (size_t l = 0; l < n; ++l) {
+                    log_likelihood_spam += hashes.count(j + l) * log_count_plus_one(min_spam[l]);
+                    log_likelihood_ham += hashes.count(j + l) * log_count_plus_one(min_ham[l]);
+                }
+                continue;
+            }
 
-            log_likelihood += log(static_cast<double>(min_count + 1) / (calculateTotalCount(cms)+1));
+            for (size_t l = 0; l < n; ++l) {
+                log_likelihood_spam += hashes.count(j + l) * log(static_cast<double>(min_spam[l] + 1) / (total_spam_+1));
+                log_likelihood_ham += hashes.count(j + l) * log(static_cast<double>(min_ham[l] + 1) / (total_ham_+1));
+            }
         }
+    }
 
-        return log_likelihood;
+    // same as calculateLogLikelihood, with the count-mean-min estimate instead of the min
+    void calculateLogLikelihoodCountMeanMin(const NgramHashes& hashes, double& log_likelihood_spam, double& log_likelihood_ham) const {
+        // every row received total / num_hashes occurrences
+        double row_total_spam = static_cast<double>(total_spam_) / rows();
+        double row_total_ham = static_cast<double>(total_ham_) / rows();
+        double est_spam[kernels::block_size];
+        double est_ham[kernels::block_size];
+        for (size_t j = 0; j < hashes.size(); j += kernels::block_size) {
+            size_t n = std::min(kernels::block_size, hashes.size() - j);
+            if (prefetch_distance_ != 0)
+                prefetch_ngrams(hashes, j + prefetch_distance_, j + prefetch_distance_ + n);
+            kernels::count_mean_min_rows<Rows>(cms_, hasher_, hashes.data() + j, n,
+                                         row_total_spam, row_total_ham, est_spam, est_ham);
+
+            // the estimates are not integers, so the frozen log table does not apply;
+            // frozen mode still leaves out the denominators
+            for (size_t l = 0; l < n; ++l) {
+                int count = hashes.count(j + l);
+                if (frozen_) {
+                    log_likelihood_spam += count * log(est_spam[l] + 1);
+                    log_likelihood_ham += count * log(est_ham[l] + 1);
+                } else {
+                    log_likelihood_spam += count * log((est_spam[l] + 1) / (total_spam_+1));
+                    log_likelihood_ham += count * log((est_ham[l] + 1) / (total_ham_+1));
+                }
+            }
+        }
     }
 
 };
 
+using NaiveBayesCountMin = BasicNaiveBayesCountMin<>;
+
 } // namespace bdap
@@ -1,64 +1,249 @@
 #pragma once
 
+#include <algorithm>
 #include <cmath>
 #include <iostream>
+#include <stdexcept>
+#include <string>
 #include <string_view>
+#include <type_traits>
 #include <vector>
 #include "email.hpp"
 #include "base_classifier.hpp"
+#include "counters.hpp"
+#include "hashing.hpp"
+#include "instrumentation.hpp"
+#include "log_table.hpp"
+#include "snapshot.hpp"
+#include "table.hpp"
 
 namespace bdap {
 
-class NaiveBayesFeatureHashing : public BaseClf<NaiveBayesFeatureHashing> {
+// Count is the type of the table cells, see counters.hpp
+template <typename Count = int>
+class BasicNaiveBayesFeatureHashing : public BaseClf<BasicNaiveBayesFeatureHashing<Count>> {
     int seed_;
     int ngram_;
     int log_num_buckets_;
     int num_spam=0;
     int num_ham=0;
     std::vector<int> counts_;
-    std::vector<int> spam_counts_;
-    std::vector<int> ham_counts_;
+    Table<Count> spam_counts_;
+    Table<Count> ham_counts_;
+    long long total_spam_; // sum of (count + 1) over spam_counts_, kept up to date instead of summed per prediction
+    long long total_ham_;
+
+    // frozen scoring: llr_[b] = log(spam_counts_[b] + 1) - log(ham_counts_[b] + 1),
+    // kept up to date for the buckets an update touches
+    bool frozen_=false;
+    Table<float> llr_;
+
+    bool dedup_=false; // see set_dedup
+
+    // decay, see set_decay
+    size_t decay_epoch_=0; // 0 = no decay
+    double decay_factor_=1.0;
+    size_t decay_cursor_=0; // the next bucket the running decay rescales
 
 public:
     /** Do not change the signature of the constructor! */
-    NaiveBayesFeatureHashing(int ngram, int log_num_buckets)
-        : BaseClf(-1 /* set appropriate threshold */)
+    BasicNaiveBayesFeatureHashing(int ngram, int log_num_buckets)
+        : BaseClf<BasicNaiveBayesFeatureHashing>(-1 /* set appropriate threshold */)
         , seed_(0xfa4f8cc)
         , ngram_(ngram)
         , log_num_buckets_(log_num_buckets)
-        , spam_counts_(1 << log_num_buckets_, 1) // size 2^log_num_buckets_ and initialize all elemets to 1
-        , ham_counts_(1 << log_num_buckets_, 1)
+        , spam_counts_(1 << log_num_buckets_, Count(1)) // size 2^log_num_buckets_ and initialize all elemets to 1
+        , ham_counts_(1 << log_num_buckets_, Count(1))
+        , total_spam_(2 << log_num_buckets_) // every bucket starts at 1, plus 1 for Laplace smoothing
+        , total_ham_(2 << log_num_buckets_)
     {}
 
-    void update_(const Email &email) {
+    template <typename E>
+    void update_(const E& email) {
+        BDAP_STAT_TIMER(update_ns);
         // TODO implement this
-        //create an instance of the EmailIter class with n-gram size 
-        EmailIter emailiter(email, ngram_); 
+        //hash the n-grams once into the per-thread buffer
+        NgramHashes& hashes = scratch_ngram_hashes();
+        hash_email(email, hashes);
+        update_hashes(hashes, email.is_spam());
+    }
+
+    template <typename E>
+    double predict_(const E& email) const {
+        BDAP_STAT_TIMER(predict_ns);
+        // TODO implement this
+        NgramHashes& hashes = scratch_ngram_hashes();
+        hash_email(email, hashes);
+        return predict_hashes(hashes);
+    }
 
+    // fill hashes with the n-gram hashes of email (an Email or an EmailView), as used by
+    // update_hashes and predict_hashes
+    template <typename E>
+    void hash_email(const E& email, NgramHashes& hashes) const {
+        hashes.fill(email, ngram_, seed_, dedup_);
+    }
+
+    // Collapse the repeated n-grams of an email in hash_email, so update_hashes and
+    // predict_hashes handle each distinct n-gram once, scaled by its count. The
+    // scores stay the same up to rounding. Pays off for repetitive emails, see
+    // NgramHashes.
+    void set_dedup(bool dedup) { dedup_ = dedup; }
+
+    // Place the tables in huge pages and/or on a NUMA node, see table_memory.hpp.
+    // Pays off from log_num_buckets around 22, where the random lookups miss the
+    // TLB; call it before training, it copies the tables into the new memory.
+    void set_table_memory(const TableMemory& memory) {
+        spam_counts_.set_memory(memory);
+        ham_counts_.set_memory(memory);
+        llr_.set_memory(memory);
+    }
+
+    // how hash_email hashes an email
+    NgramConfig ngram_config() const { return {ngram_, seed_, dedup_}; }
+
+    void update_hashes(const NgramHashes& hashes, bool is_spam) {
+        BDAP_STAT_EMAIL(emails_updated);
+        BDAP_STAT_ADD(table_lookups, hashes.size());
         //calculate the spam/ham emails
-         if(email.is_spam()){
+         if(is_spam){
             num_spam++;
         } else{
             num_ham++;
         }
 
-        while (emailiter) {
-            std::string_view ngram = emailiter.next(); //iterate through the n grams and extract one at the time 
-            size_t bucket = get_bucket (ngram , email.is_spam()); // hash the n-grams to a bucket
-        
-            if (email.is_spam()) {
-            spam_counts_[bucket]++; // Increment the count of the bucket for spam
+        // every occurrence adds one to some bucket, except to a counter stuck at its maximum
+        long long added = 0;
+        for (size_t j = 0; j < hashes.size(); ++j) {
+            size_t bucket = get_bucket (hashes.data()[j] , is_spam); // hash the n-grams to a bucket
+            int count = hashes.count(j); // occurrences of the n-gram in the email
+
+            if (is_spam) {
+            added += increment_delta(spam_counts_[bucket], count); // Increment the count of the bucket for spam
             } else {
-            ham_counts_[bucket]++;  // Increment the count of the bucket for ham
+            added += increment_delta(ham_counts_[bucket], count);  // Increment the count of the bucket for ham
             }
+
+            if (frozen_)
+                llr_[bucket] = bucket_llr(bucket);
         }
+        (is_spam ? total_spam_ : total_ham_) += added;
+
+        if (decay_epoch_ != 0)
+            decay_slice();
     }
 
-    double predict_(const Email& email) const {
-        // TODO implement this
-       
-        int total_spam=0; //total spam words-ngrams
-        int total_ham=0;  //total ham words-ngrams
+    // Exponential forgetting for drifting streams: every count (and the class
+    // counts) is multiplied by factor once per epoch updates, so an email weighs
+    // about factor^(age / epoch). Each update rescales the next 1/epoch of the
+    // buckets rather than every epoch-th update the whole tables, so no update
+    // waits on a full rewrite. It bounds the counts, so the int counters no
+    // longer overflow on a long stream. Morris counters decay at random, see
+    // round_count. epoch 0 turns it off.
+    void set_decay(size_t epoch, double factor) {
+        decay_epoch_ = epoch;
+        decay_factor_ = factor;
+        decay_cursor_ = 0;
+    }
+
+    // multiply everything seen so far by factor now, e.g. once a week; integer
+    // counts are rounded down, so n-grams seen once are forgotten by any factor < 1
+    void decay(double factor) {
+        num_spam = decay_class_count(num_spam, factor);
+        num_ham = decay_class_count(num_ham, factor);
+        scale_buckets(0, spam_counts_.size(), factor);
+    }
+
+    // Frozen scoring: score from a per-bucket table of log-likelihood ratios
+    // (spam minus ham) instead of two logs per n-gram, so scoring is a gather
+    // and a sum. The table is built once here and then kept up to date by
+    // update_ for the buckets it touches. It is stored as float, so scores
+    // differ from the exact ones in the last digits.
+    void set_frozen_scoring(bool frozen) {
+        frozen_ = frozen;
+        if (frozen_)
+            rebuild_llr();
+        else
+            llr_ = Table<float>();
+    }
+
+    // add the counts of a model trained on another part of the stream (another thread or
+    // node); the result is the model trained on both parts only if merges_exactly()
+    void merge(const BasicNaiveBayesFeatureHashing& other) {
+        if (ngram_ != other.ngram_ || seed_ != other.seed_ || log_num_buckets_ != other.log_num_buckets_)
+            throw std::invalid_argument("NaiveBayesFeatureHashing::merge: models have different parameters");
+        num_spam += other.num_spam;
+        num_ham += other.num_ham;
+        // both tables start at 1, keep that initial count only once
+        for (size_t i = 0; i < spam_counts_.size(); ++i) {
+            spam_counts_[i] = Count(count_value(spam_counts_[i]) + count_value(other.spam_counts_[i]) - 1);
+            ham_counts_[i] = Count(count_value(ham_counts_[i]) + count_value(other.ham_counts_[i]) - 1);
+        }
+        total_spam_ += other.total_spam_ - (2 << log_num_buckets_);
+        total_ham_ += other.total_ham_ - (2 << log_num_buckets_);
+        if (frozen_)
+            rebuild_llr();
+    }
+
+    // see NaiveBayesCountMin::merges_exactly
+    bool merges_exactly() const { return std::is_arithmetic<Count>::value && decay_epoch_ == 0; }
+
+    // forget everything seen so far, keep the parameters
+    void clear() {
+        num_spam = 0;
+        num_ham = 0;
+        spam_counts_.fill(Count(1));
+        ham_counts_.fill(Count(1));
+        total_spam_ = 2 << log_num_buckets_;
+        total_ham_ = 2 << log_num_buckets_;
+        if (frozen_)
+            rebuild_llr();
+    }
+
+    // write the model to a snapshot file, see snapshot.hpp
+    void save(const std::string& path) const {
+        SnapshotWriter writer(make_snapshot_header(SnapshotKind::NaiveBayesFeatureHashing));
+        SnapshotHeader& header = writer.header();
+        header.ngram = ngram_;
+        header.log_num_buckets = log_num_buckets_;
+        header.seed = seed_;
+        header.cell_types = cell_types_code<Count, Count>();
+        header.num_spam = num_spam;
+        header.num_ham = num_ham;
+        header.total_spam = total_spam_;
+        header.total_ham = total_ham_;
+        header.decay_epoch = decay_epoch_;
+        header.decay_factor = decay_factor_;
+        header.decay_cursor = decay_cursor_;
+        writer.add_table(spam_counts_);
+        writer.add_table(ham_counts_);
+        writer.write(path);
+    }
+
+    // map a snapshot written by save, the model then scores straight from the mapped file
+    static BasicNaiveBayesFeatureHashing load(const std::string& path) {
+        return BasicNaiveBayesFeatureHashing(SnapshotReader(path, SnapshotKind::NaiveBayesFeatureHashing,
+                                                            cell_types_code<Count, Count>()));
+    }
+
+    // bytes held by the count tables
+    size_t memory_bytes() const { return (spam_counts_.size() + ham_counts_.size()) * sizeof(Count); }
+
+    // occupancy of the count tables, see instrumentation.hpp; a bucket is in use once
+    // its spam or ham count left the initial 1
+    TableStats table_stats() const {
+        size_t nonzero = 0;
+        for (size_t b = 0; b < spam_counts_.size(); ++b)
+            nonzero += count_value(spam_counts_[b]) != 1 || count_value(ham_counts_[b]) != 1;
+        return make_table_stats(1, spam_counts_.size(), nonzero);
+    }
+
+    double predict_hashes(const NgramHashes& hashes) const {
+        BDAP_STAT_EMAIL(emails_predicted);
+        BDAP_STAT_ADD(table_lookups, hashes.size());
+        //total spam/ham words-ngrams, with 1 added to every bucket for Laplace smoothing
+        long long total_spam=total_spam_;
+        long long total_ham=total_ham_;
 
 
         //calculate P(S) and P(H)
@@ -66,29 +251,28 @@ public:
         double log_prob_spam = log(static_cast<double>(num_spam)/(num_spam+num_ham));
         double log_prob_ham = log(static_cast<double>(num_ham)/(num_spam+num_ham));
 
-        //calculate P(W|S) and P(W|H)
-
-        //add 1 for Laplace smoothing
-        for(const int& count  :spam_counts_){
-            total_spam = total_spam +count + 1; //total counts of ngrams in spam class
+        if (frozen_) {
+            // sum the per-bucket ratios, the denominators are the same for every n-gram
+            double llr = 0.0;
+            for (size_t j = 0; j < hashes.size(); ++j)
+                llr += hashes.count(j) * llr_[get_bucket(hashes.data()[j], 0)];
+            double log_denominators = log(static_cast<double>(total_ham + 2)) - log(static_cast<double>(total_spam + 2));
+            return llr + hashes.num_ngrams() * log_denominators + log_prob_spam - log_prob_ham;
         }
 
-        for(const int& count : ham_counts_){
-            total_ham = total_ham + count + 1; //total counts of ngrams in ham class
-        }
+        //calculate P(W|S) and P(W|H)
 
         double log_like_prob_spam=0.0;
         double log_like_prob_ham=0.0;
 
-        //calculate the log-likelihood of each n-gram occurrence given spam or ham class 
+        //calculate the log-likelihood of each n-gram occurrence given spam or ham class, once per distinct n-gram times its count
         //add 1 to the numerator and 2 to the denominator (we have 2 classes -. each feature has 2 possible outcomes) for Laplace smoothing
-        EmailIter emailiter(email, ngram_); 
-        while (emailiter) {
-            std::string_view ngram = emailiter.next();
-            size_t bucket = get_bucket(ngram, email.is_spam());
+        for (size_t j = 0; j < hashes.size(); ++j) {
+            size_t bucket = get_bucket(hashes.data()[j], 0);
+            int count = hashes.count(j);
 
-            log_like_prob_spam += log(static_cast<double>(spam_counts_[bucket] + 1) / (total_spam + 2 ));
-            log_like_prob_ham +=log(static_cast<double>(ham_counts_[bucket] + 1) / (total_ham + 2 ));
+            log_like_prob_spam += count * log(static_cast<double>(count_value(spam_counts_[bucket]) + 1) / (total_spam + 2 ));
+            log_like_prob_ham += count * log(static_cast<double>(count_value(ham_counts_[bucket]) + 1) / (total_ham + 2 ));
         }
 
         //calculate P(S|text)
@@ -100,6 +284,76 @@ public:
     }
 
 private:
+    explicit BasicNaiveBayesFeatureHashing(const SnapshotReader& snapshot)
+        : BaseClf<BasicNaiveBayesFeatureHashing>(-1 /* same threshold as the public constructor */)
+        , seed_(snapshot.header().seed)
+        , ngram_(snapshot.header().ngram)
+        , log_num_buckets_(snapshot.header().log_num_buckets)
+        , num_spam(static_cast<int>(snapshot.header().num_spam))
+        , num_ham(static_cast<int>(snapshot.header().num_ham))
+        , spam_counts_(snapshot.template table<Count>(0))
+        , ham_counts_(snapshot.template table<Count>(1))
+        , total_spam_(snapshot.header().total_spam)
+        , total_ham_(snapshot.header().total_ham)
+        , decay_epoch_(snapshot.header().decay_epoch)
+        , decay_factor_(snapshot.header().decay_factor)
+        , decay_cursor_(snapshot.header().decay_cursor)
+    {
+        size_t num_buckets = static_cast<size_t>(1) << log_num_buckets_;
+        if (spam_counts_.size() != num_buckets || ham_counts_.size() != num_buckets || decay_cursor_ > num_buckets)
+            throw std::runtime_error("corrupt NaiveBayesFeatureHashing snapshot");
+    }
+
+    float bucket_llr(size_t bucket) const {
+        return static_cast<float>(log_count_plus_one(count_value(spam_counts_[bucket]))
+                                  - log_count_plus_one(count_value(ham_counts_[bucket])));
+    }
+
+    // rescales the next 1/decay_epoch_ of the buckets, the class counts at the end of every sweep
+    void decay_slice() {
+        size_t slice = (spam_counts_.size() + decay_epoch_ - 1) / decay_epoch_;
+        size_t end = std::min(decay_cursor_ + slice, spam_counts_.size());
+        scale_buckets(decay_cursor_, end, decay_factor_);
+        decay_cursor_ = end;
+        if (decay_cursor_ == spam_counts_.size()) {
+            decay_cursor_ = 0;
+            num_spam = decay_class_count(num_spam, decay_factor_);
+            num_ham = decay_class_count(num_ham, decay_factor_);
+        }
+    }
+
+    // The initial count of 1 is the prior, only the counts on top of it decay. The
+    // totals change by what the rounding left of the counts, as in
+    // NaiveBayesCountMin::scale_cells, so they stay the sums plus 1 per bucket.
+    void scale_buckets(size_t begin, size_t end, double factor) {
+        long long spam_delta = 0;
+        long long ham_delta = 0;
+        for (size_t b = begin; b < end; ++b) {
+            auto spam = count_value(spam_counts_[b]);
+            auto ham = count_value(ham_counts_[b]);
+            spam_counts_[b] = round_count<Count>((spam - 1) * factor + 1);
+            ham_counts_[b] = round_count<Count>((ham - 1) * factor + 1);
+            spam_delta += static_cast<long long>(count_value(spam_counts_[b]) - spam);
+            ham_delta += static_cast<long long>(count_value(ham_counts_[b]) - ham);
+            if (frozen_)
+                llr_[b] = bucket_llr(b);
+        }
+        total_spam_ += spam_delta;
+        total_ham_ += ham_delta;
+    }
+
+    // a class that was seen keeps a count of at least 1, so its prior stays finite
+    static int decay_class_count(int n, double factor) {
+        return n > 0 ? std::max(1, static_cast<int>(std::lround(n * factor))) : 0;
+    }
+
+    void rebuild_llr() {
+        if (llr_.size() != spam_counts_.size())
+            llr_ = Table<float>(spam_counts_.size(), 0.0f, spam_counts_.memory());
+        for (size_t b = 0; b < llr_.size(); ++b)
+            llr_[b] = bucket_llr(b);
+    }
+
     size_t get_bucket(std::string_view ngram, int is_spam) const {
         return get_bucket(hash(ngram, seed_), is_spam);
     }
@@ -108,11 +362,14 @@ private:
         // TODO limit the range of the hash values here
         // first i get the number of buckets from their logarithmic representation using bit manipulation
         size_t num_buckets = 1 << log_num_buckets_;
-        hash=hash%num_buckets; //apply modulo to ensure that the hash value falls into the range of available buckets -> prevent overflow
+        hash=hash&(num_buckets-1); //num_buckets is a power of two, so masking the low bits is the same as the modulo -> prevent overflow
         return hash;
     }
 
 
 };
+
+using NaiveBayesFeatureHashing = BasicNaiveBayesFeatureHashing<>;
+
  // namespace bdap
 }
\ No newline at end of file
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+namespace bdap {
+
+// number of worker threads to use when the caller asks for 0
+inline int default_num_threads() {
+    return std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+}
+
+// Splits [0, n) into num_threads contiguous chunks and runs
+// fn(worker, begin, end) for each chunk on its own thread. Returns when all
+// chunks are done. The calling thread runs the first chunk itself.
+template <typename Fn>
+void parallel_chunks(size_t n, int num_threads, Fn fn) {
+    if (num_threads <= 0)
+        num_threads = default_num_threads();
+    num_threads = static_cast<int>(std::min<size_t>(num_threads, std::max<size_t>(n, 1)));
+
+    size_t chunk = n / num_threads;
+    size_t rest = n % num_threads;
+    auto chunk_begin = [&](int w) {
+        return w * chunk + std::min<size_t>(w, rest);
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(num_threads - 1);
+    for (int w = 1; w < num_threads; ++w)
+        workers.emplace_back(fn, w, chunk_begin(w), chunk_begin(w + 1));
+    fn(0, chunk_begin(0), chunk_begin(1));
+
+    for (std::thread& t : workers)
+        t.join();
+}
+
+} // namespace bdap
@@ -3,122 +3,274 @@
 #include <algorithm>
 #include <iostream>
 #include <numeric>
+#include <stdexcept>
+#include <string>
 #include <string_view>
 #include <vector>
 #include "email.hpp"
 #include "base_classifier.hpp"
+#include "count_min_sketch.hpp"
+#include "counters.hpp"
+#include "hashing.hpp"
+#include "instrumentation.hpp"
+#include "snapshot.hpp"
+#include "sketch_kernels.hpp"
 
 namespace bdap {
 
-class PerceptronCountMin : public BaseClf<PerceptronCountMin> {
+// Weight and Count are the types of the weight and count sketch cells, see counters.hpp.
+// Rows != 0 fixes num_hashes at compile time, see dispatch.hpp.
+template <typename Weight = double, typename Count = double, int Rows = 0>
+class BasicPerceptronCountMin : public BaseClf<BasicPerceptronCountMin<Weight, Count, Rows>> {
     int ngram_;
     int seed_;
     int log_num_buckets_;
     double learning_rate_;
     double bias_;
     int num_hashes_;
-    std::vector<std::vector<double>> weights_;
-    std::vector<std::vector<double>> counts_;
+    CountMinSketch<Weight, Count> sketch_; // first = weight, second = count of the same bucket
+    RowHasher hasher_;
+    bool dedup_=false; // see set_dedup
+
+    // averaged mode, see set_averaged: weight_sums_ has one sum per sketch cell, in
+    // the same order, of num_seen_ times the changes of its weight
+    bool averaged_=false;
+    Table<double> weight_sums_;
+    double bias_sum_=0.0;
+    double num_seen_=1.0; // 1 + emails trained on since averaging was turned on
+
+    size_t prefetch_distance_=0; // see set_prefetch_distance
 
 public:
     /** Do not change the signature of the constructor! */
-    PerceptronCountMin(int ngram, int num_hashes, int log_num_buckets,
-                       double learning_rate)
-        : BaseClf(0.0 /* set appropriate threshold */)
+    BasicPerceptronCountMin(int ngram, int num_hashes, int log_num_buckets,
+                            double learning_rate)
+        : BaseClf<BasicPerceptronCountMin>(0.0 /* set appropriate threshold */)
         , ngram_(ngram)
         , num_hashes_(num_hashes)
         , log_num_buckets_(log_num_buckets)
         , learning_rate_(learning_rate)
         , bias_(0.0)
         , seed_(0xa738cc)
-       
+        , sketch_(num_hashes, log_num_buckets) // weights and counts matrix, initialized to 0
+        , hasher_(seed_, log_num_buckets)
     {
-        size_t num_buckets_ = 1 << log_num_buckets_;
+        if (Rows != 0 && num_hashes != Rows)
+            throw std::invalid_argument("PerceptronCountMin: num_hashes does not match the Rows template argument");
+    }
 
-        // create a weights matrix and initialize to 0
-        weights_.resize(num_hashes_);
-        for (int i=0; i<num_hashes_; ++i){
-            weights_[i].resize(num_buckets_,0);
-        }
+    template <typename E>
+    void update_(const E& email) {
+        BDAP_STAT_TIMER(update_ns);
+        // TODO implement this
+        //hash the n-grams once into the per-thread buffer, the prediction below reuses them
+        NgramHashes& hashes = scratch_ngram_hashes();
+        hash_email(email, hashes);
+        update_hashes(hashes, email.is_spam());
+    }
 
-        // create a counts matrix and initialize to 0
-        counts_.resize(num_hashes_);
-        for (int i=0; i<num_hashes_; ++i){
-            counts_[i].resize(num_buckets_,0);
-        }
+    template <typename E>
+    double predict_(const E& email) const {
+        BDAP_STAT_TIMER(predict_ns);
+        // TODO implement this
+        NgramHashes& hashes = scratch_ngram_hashes();
+        hash_email(email, hashes);
+        return predict_hashes(hashes);
+    }
+
+    // fill hashes with the n-gram hashes of email (an Email or an EmailView), as used by
+    // update_hashes and predict_hashes
+    template <typename E>
+    void hash_email(const E& email, NgramHashes& hashes) const {
+        hashes.fill(email, ngram_, seed_, dedup_);
+    }
 
+    // Collapse repeated n-grams before the lookups, see NaiveBayesFeatureHashing::set_dedup.
+    // The update still takes one step per occurrence and row, so the weights do not change.
+    void set_dedup(bool dedup) { dedup_ = dedup; }
 
+    // see NaiveBayesFeatureHashing::set_table_memory
+    void set_table_memory(const TableMemory& memory) {
+        sketch_.set_memory(memory);
+        weight_sums_.set_memory(memory);
     }
 
-    void update_(const Email& email) {
-        // TODO implement this
-        //create an instance of the EmailIter class with n-gram size
-        EmailIter emailiter(email, ngram_);
-        size_t num_buckets_ = 1 << log_num_buckets_;
+    // how hash_email hashes an email
+    NgramConfig ngram_config() const { return {ngram_, seed_, dedup_}; }
 
-        
+    void update_hashes(const NgramHashes& hashes, bool is_spam) {
+        BDAP_STAT_EMAIL(emails_updated);
+        BDAP_STAT_ADD(table_lookups, hashes.size() * rows());
         //label email 1 if it's spam or -1 if it's ham 
         int label;
-        if (email.is_spam()) {
+        if (is_spam) {
             label = 1;
         } else {
             label = -1;
         }
 
-        double prediction=activate(predict_(email));
+        double prediction=activate(current_score(hashes));
         double error=label-prediction;
 
-        for(int i=0; i<num_hashes_; ++i){
-            EmailIter emailiter(email, ngram_);
+        if (averaged_) {
+            update_averaged(hashes, error);
+            return;
+        }
+
+        for(int i=0; i<rows(); ++i){
             bias_+=learning_rate_*error;
+        }
 
-            while(emailiter){
-                std::string_view ngram_= emailiter.next();
-                size_t bucket = hash(ngram_, seed_ + i) % num_buckets_;
-                counts_[i][bucket]++;
-                weights_[i][bucket]+=learning_rate_*error*counts_[i][bucket];
+        // rows are independent, so every row is updated from the same hash of the n-gram
+        // and every occurrence of an n-gram is one step, each with the count after it
+        for(size_t j=0; j<hashes.size(); ++j){
+            RowHasher::Probe probe = hasher_.probe(hashes.data()[j]);
+            for(int i=0; i<rows(); ++i){
+                auto& cell = sketch_.at(i, hasher_.bucket(probe, i));
+                for(int k=0; k<hashes.count(j); ++k){
+                    increment(cell.second);
+                    cell.first+=static_cast<Weight>(learning_rate_*error*count_value(cell.second));
+                }
             }
         }
                 
     }
 
-    double predict_(const Email& email) const {
-        // TODO implement this
-         //create an instance of the EmailIter class with n-gram size
-        EmailIter emailiter(email, ngram_);
-        size_t num_buckets_ = 1 << log_num_buckets_;
+    double predict_hashes(const NgramHashes& hashes) const {
+        BDAP_STAT_EMAIL(emails_predicted);
+        BDAP_STAT_ADD(table_lookups, hashes.size() * rows());
+        return averaged_ ? averaged_score(hashes) : current_score(hashes);
+    }
+
+    // Averaged perceptron: update only on mistakes and score with the average of
+    // the weights over all emails trained on since this was turned on (Daume's
+    // lazy averaging, see PerceptronFeatureHashing::set_averaged). A correct
+    // email no longer rewrites num_hashes cells per n-gram. The averaged score
+    // takes the median of the averaged weights over the rows, like the default
+    // score does of the weights. Snapshots store the sums, like those of
+    // PerceptronFeatureHashing.
+    void set_averaged(bool averaged) {
+        averaged_ = averaged;
+        bias_sum_ = 0.0;
+        num_seen_ = 1.0;
+        weight_sums_ = averaged ? Table<double>(sketch_.size(), 0.0, sketch_.memory()) : Table<double>();
+    }
+
+
+    // see NaiveBayesCountMin::set_prefetch_distance
+    void set_prefetch_distance(size_t distance) { prefetch_distance_ = distance; }
+
+    // start loading the cells of the n-grams [begin, end) of hashes into the cache,
+    // with their sums in the averaged mode
+    void prefetch_ngrams(const NgramHashes& hashes, size_t begin, size_t end) const {
+        for (size_t j = begin; j < std::min(end, hashes.size()); ++j) {
+            RowHasher::Probe probe = hasher_.probe(hashes.data()[j]);
+            for (int i = 0; i < rows(); ++i) {
+                size_t bucket = hasher_.bucket(probe, i);
+                __builtin_prefetch(&sketch_.at(i, bucket));
+                if (averaged_)
+                    __builtin_prefetch(&weight_sums_[cell_index(i, bucket)]);
+            }
+        }
+    }
+
+    template <typename E>
+    void update_batch_(const E* emails, size_t n) {
+        prefetched_update_batch(*this, emails, n, prefetch_distance_);
+    }
+
+    template <typename E>
+    void predict_batch_(const E* emails, size_t n, double* scores) const {
+        prefetched_predict_batch(*this, emails, n, scores, prefetch_distance_);
+    }
+
+    // write the model to a snapshot file, see snapshot.hpp
+    void save(const std::string& path) const {
+        SnapshotWriter writer(make_snapshot_header(SnapshotKind::PerceptronCountMin));
+        SnapshotHeader& header = writer.header();
+        header.ngram = ngram_;
+        header.num_hashes = num_hashes_;
+        header.log_num_buckets = log_num_buckets_;
+        header.seed = seed_;
+        header.cell_types = cell_types_code<Weight, Count>();
+        header.learning_rate = learning_rate_;
+        header.bias = bias_;
+        writer.add_table(sketch_.cells());
+        if (averaged_) {
+            header.bias_sum = bias_sum_;
+            header.num_seen = num_seen_;
+            writer.add_table(weight_sums_);
+        }
+        writer.write(path);
+    }
+
+    // map a snapshot written by save, the model then scores straight from the mapped file
+    static BasicPerceptronCountMin load(const std::string& path) {
+        return BasicPerceptronCountMin(SnapshotReader(path, SnapshotKind::PerceptronCountMin,
+                                                      cell_types_code<Weight, Count>()));
+    }
+
+    // bytes held by the sketch (and the sums of the averaged mode)
+    size_t memory_bytes() const {
+        return sketch_.size() * sizeof(typename CountMinSketch<Weight, Count>::Cell) + weight_sums_.size() * sizeof(double);
+    }
+
+    // occupancy of the sketch, see instrumentation.hpp
+    TableStats table_stats() const {
+        size_t nonzero = 0;
+        const auto* cells = sketch_.data();
+        for (size_t c = 0; c < sketch_.size(); ++c)
+            nonzero += count_value(cells[c].second) != 0;
+        return make_table_stats(num_hashes_, sketch_.num_buckets(), nonzero);
+    }
 
-        std::vector<int> weight(num_hashes_);
+private:
+    explicit BasicPerceptronCountMin(const SnapshotReader& snapshot)
+        : BaseClf<BasicPerceptronCountMin>(0.0 /* same threshold as the public constructor */)
+        , ngram_(snapshot.header().ngram)
+        , seed_(snapshot.header().seed)
+        , log_num_buckets_(snapshot.header().log_num_buckets)
+        , learning_rate_(snapshot.header().learning_rate)
+        , bias_(snapshot.header().bias)
+        , num_hashes_(snapshot.header().num_hashes)
+        , sketch_(num_hashes_, log_num_buckets_, snapshot.template table<typename CountMinSketch<Weight, Count>::Cell>(0))
+        , hasher_(seed_, log_num_buckets_)
+    {
+        if (sketch_.size() != static_cast<size_t>(num_hashes_) << log_num_buckets_)
+            throw std::runtime_error("corrupt PerceptronCountMin snapshot");
+        if (Rows != 0 && num_hashes_ != Rows)
+            throw std::runtime_error("PerceptronCountMin snapshot has a different number of rows");
+        if (snapshot.header().num_seen > 0.0) {
+            averaged_ = true;
+            bias_sum_ = snapshot.header().bias_sum;
+            num_seen_ = snapshot.header().num_seen;
+            weight_sums_ = snapshot.template table<double>(1);
+            if (weight_sums_.size() != sketch_.size())
+                throw std::runtime_error("corrupt PerceptronCountMin snapshot");
+        }
+    }
+
+    // num_hashes_, known at compile time when Rows != 0
+    int rows() const { return Rows != 0 ? Rows : num_hashes_; }
+
+    // score with the current weights, as used for training
+    double current_score(const NgramHashes& hashes) const {
         double prediction = 0.0;
 
-        while (emailiter) {
-            std::string_view ngram_= emailiter.next();
-            
-            for (int i = 0; i < num_hashes_; ++i) {
-                size_t bucket = hash(ngram_, seed_ + i) % num_buckets_;
-                weight[i] = weights_[i][bucket];
-            }  
+        // the median weight over the hash functions and the sum of the counts are computed
+        // a block of n-grams at a time
+        double medianWeight[kernels::block_size];
+        double countSum[kernels::block_size];
+        for (size_t j = 0; j < hashes.size(); j += kernels::block_size) {
+            size_t n = std::min(kernels::block_size, hashes.size() - j);
+            if (prefetch_distance_ != 0)
+                prefetch_ngrams(hashes, j + prefetch_distance_, j + prefetch_distance_ + n);
+            kernels::median_rows<Rows>(sketch_, hasher_, hashes.data() + j, n, medianWeight, countSum);
 
-            
             // Calculate the dot product using only the hash function with the medianweight
-            std::sort(weight.begin(), weight.end());
-            int medianWeight;
-
-            if (num_hashes_ % 2 == 0) {
-                // If even, average the two middle values
-                int mid1= weight[num_hashes_ / 2 - 1];
-                int mid2 = weight[num_hashes_ / 2];
-                medianWeight = (mid1 + mid2) / 2;
-            } else {
-                // If odd, take the middle value
-                medianWeight = weight[num_hashes_ / 2];
-            }
-            
-            for (int i = 0; i < num_hashes_; ++i) {
-                size_t bucket = hash(ngram_, seed_ + i) % num_buckets_;
-                prediction += medianWeight * counts_[i][bucket];
-            } 
-        
+            // a distinct n-gram counts as often as it occurs
+            for (size_t l = 0; l < n; ++l)
+                prediction += hashes.count(j + l) * medianWeight[l] * countSum[l];
         }
 
         prediction+=bias_;
@@ -127,7 +279,63 @@ public:
         return prediction;
     }
 
-private:
+    // score with the averaged weights
+    double averaged_score(const NgramHashes& hashes) const {
+        int k = rows();
+        double inv_seen = 1.0 / num_seen_;
+        double local[kernels::max_simd_median_rows];
+        std::vector<double> large; // only used for more rows than fit in local
+        double* w = local;
+        if (k > kernels::max_simd_median_rows) {
+            large.resize(k);
+            w = large.data();
+        }
+
+        double prediction = 0.0;
+        for (size_t j = 0; j < hashes.size(); ++j) {
+            if (prefetch_distance_ != 0 && j % kernels::block_size == 0)
+                prefetch_ngrams(hashes, j + prefetch_distance_, j + prefetch_distance_ + kernels::block_size);
+            RowHasher::Probe probe = hasher_.probe(hashes.data()[j]);
+            double count = 0.0;
+            for (int i = 0; i < k; ++i) {
+                size_t bucket = hasher_.bucket(probe, i);
+                w[i] = sketch_.at(i, bucket).first - weight_sums_[cell_index(i, bucket)] * inv_seen;
+                count += count_value(sketch_.at(i, bucket).second);
+            }
+            std::sort(w, w + k);
+            double median = k % 2 == 0 ? (w[k / 2 - 1] + w[k / 2]) / 2 : w[k / 2];
+            prediction += hashes.count(j) * median * count;
+        }
+        return prediction + bias_ - bias_sum_ * inv_seen;
+    }
+
+    void update_averaged(const NgramHashes& hashes, double error) {
+        if (error != 0) {
+            for (int i = 0; i < rows(); ++i) {
+                bias_ += learning_rate_ * error;
+                bias_sum_ += num_seen_ * learning_rate_ * error;
+            }
+            for (size_t j = 0; j < hashes.size(); ++j) {
+                RowHasher::Probe probe = hasher_.probe(hashes.data()[j]);
+                for (int i = 0; i < rows(); ++i) {
+                    size_t bucket = hasher_.bucket(probe, i);
+                    auto& cell = sketch_.at(i, bucket);
+                    for (int k = 0; k < hashes.count(j); ++k) {
+                        increment(cell.second);
+                        Weight delta = static_cast<Weight>(learning_rate_ * error * count_value(cell.second));
+                        cell.first += delta;
+                        weight_sums_[cell_index(i, bucket)] += num_seen_ * delta;
+                    }
+                }
+            }
+        }
+        num_seen_ += 1.0;
+    }
+
+    // index of a sketch cell in weight_sums_
+    size_t cell_index(int row, size_t bucket) const {
+        return (static_cast<size_t>(row) << log_num_buckets_) + bucket;
+    }
 
     // activation function
     double activate(double value) const {
@@ -140,4 +348,6 @@ private:
 
 };
 
+using PerceptronCountMin = BasicPerceptronCountMin<>;
+
 } // namespace bdap
@@ -1,76 +1,220 @@
 #pragma once
 
+#include <algorithm>
 #include <iostream>
+#include <stdexcept>
+#include <string>
 #include <string_view>
 #include <vector>
 #include "email.hpp"
 #include "base_classifier.hpp"
+#include "counters.hpp"
+#include "hashing.hpp"
+#include "instrumentation.hpp"
+#include "snapshot.hpp"
+#include "table.hpp"
 
 namespace bdap {
 
-class PerceptronFeatureHashing : public BaseClf<PerceptronFeatureHashing> {
+// Weight and Count are the types of the weight and count table cells, see counters.hpp
+template <typename Weight = double, typename Count = int>
+class BasicPerceptronFeatureHashing : public BaseClf<BasicPerceptronFeatureHashing<Weight, Count>> {
     int ngram_;
     int log_num_buckets_;
     double learning_rate_;
     double bias_;
-    std::vector<double> weights_;
-    std::vector<int> counts_;
+    Table<Weight> weights_;
+    Table<Count> counts_;
 
     int seed_;
 
+    bool dedup_=false; // see set_dedup
+
+    // averaged mode, see set_averaged: weight_sums_[b] is the sum over the updates of
+    // num_seen_ times the change of weights_[b], and bias_sum_ the same for bias_
+    bool averaged_=false;
+    Table<double> weight_sums_;
+    double bias_sum_=0.0;
+    double num_seen_=1.0; // 1 + emails trained on since averaging was turned on
+
 public:
     /** Do not change the signature of the constructor! */
-    PerceptronFeatureHashing(int ngram, int log_num_buckets, double learning_rate)
-        : BaseClf(0.0 /* set appropriate threshold */)
+    BasicPerceptronFeatureHashing(int ngram, int log_num_buckets, double learning_rate)
+        : BaseClf<BasicPerceptronFeatureHashing>(0.0 /* set appropriate threshold */)
         , ngram_(ngram)
         , log_num_buckets_(log_num_buckets)
         , learning_rate_(learning_rate)
         , bias_(0.0)
         , seed_(0xa738cc)
-        , counts_(1 << log_num_buckets_, 0) // size 2^log_num_buckets_ and initialize all elemets to 0
-    {
-        // set all weights to zero
-        weights_.resize(1 << log_num_buckets_, 0.0);
-    }
+        , weights_(1 << log_num_buckets_, Weight(0)) // set all weights to zero
+        , counts_(1 << log_num_buckets_, Count(0)) // size 2^log_num_buckets_ and initialize all elemets to 0
+    {}
 
-    void update_(const Email& email) {
+    template <typename E>
+    void update_(const E& email) {
+        BDAP_STAT_TIMER(update_ns);
         // TODO implement this
-        //create an instance of the EmailIter class with n-gram size 
-        EmailIter emailiter(email, ngram_); 
+        //hash the n-grams once into the per-thread buffer, the prediction below reuses them
+        NgramHashes& hashes = scratch_ngram_hashes();
+        hash_email(email, hashes);
+        update_hashes(hashes, email.is_spam());
+    }
+           
+    template <typename E>
+    double predict_(const E& email) const {
+        BDAP_STAT_TIMER(predict_ns);
+        // TODO implement this
+        NgramHashes& hashes = scratch_ngram_hashes();
+        hash_email(email, hashes);
+        return predict_hashes(hashes);
+    }
+
+    // fill hashes with the n-gram hashes of email (an Email or an EmailView), as used by
+    // update_hashes and predict_hashes
+    template <typename E>
+    void hash_email(const E& email, NgramHashes& hashes) const {
+        hashes.fill(email, ngram_, seed_, dedup_);
+    }
+
+    // Collapse repeated n-grams before the lookups, see NaiveBayesFeatureHashing::set_dedup.
+    // The update still takes one step per occurrence, so the weights do not change.
+    void set_dedup(bool dedup) { dedup_ = dedup; }
 
+    // see NaiveBayesFeatureHashing::set_table_memory
+    void set_table_memory(const TableMemory& memory) {
+        weights_.set_memory(memory);
+        counts_.set_memory(memory);
+        weight_sums_.set_memory(memory);
+    }
+
+    // how hash_email hashes an email
+    NgramConfig ngram_config() const { return {ngram_, seed_, dedup_}; }
+
+    void update_hashes(const NgramHashes& hashes, bool is_spam) {
+        BDAP_STAT_EMAIL(emails_updated);
+        BDAP_STAT_ADD(table_lookups, hashes.size());
         //label email 1 if it's spam or -1 if it's ham 
         int label;
-        if (email.is_spam()) {
+        if (is_spam) {
             label = 1;
         } else {
             label = -1;
         }
 
-        double prediction=predict_(email);
+        double prediction=current_score(hashes);
         double error=label-activate(prediction);
 
+        if (averaged_) {
+            update_averaged(hashes, error);
+            return;
+        }
 
         bias_ += learning_rate_ * error;
 
 
-        while (emailiter) {
-            std::string_view ngram = emailiter.next(); //iterate through the n grams and extract one at the time 
-            size_t bucket = get_bucket(ngram ); // hash the n-grams to a bucket
-            counts_[bucket]++; //increment the count of the bucket
+        for (size_t j = 0; j < hashes.size(); ++j) {
+            size_t bucket = get_bucket(hashes.data()[j]); // map the n-gram hash to a bucket
+            Count& count = counts_[bucket];
+            Weight& weight = weights_[bucket];
+            // one step per occurrence of the n-gram, each with the count after it
+            for (int k = hashes.count(j); k > 0; --k) {
+                increment(count); //increment the count of the bucket
 
-            weights_[bucket] += learning_rate_ * error*counts_[bucket];
+                weight += static_cast<Weight>(learning_rate_ * error*count_value(count));
+            }
         }
     }
            
-    double predict_(const Email& email) const {
-        // TODO implement this
-        EmailIter emailiter(email, ngram_);
+    double predict_hashes(const NgramHashes& hashes) const {
+        BDAP_STAT_EMAIL(emails_predicted);
+        BDAP_STAT_ADD(table_lookups, hashes.size());
+        return averaged_ ? averaged_score(hashes) : current_score(hashes);
+    }
+
+    // Averaged perceptron: update only on mistakes and score with the average of
+    // the weights over all emails trained on since this was turned on, which is
+    // less noisy than the last weights. The average is kept lazily (Daume's
+    // trick): every update also adds num_seen_ times its change to a sum, and the
+    // average is weights - sums / num_seen_, so an email costs nothing when it is
+    // classified correctly and O(n-grams) when it is not. In this mode the count
+    // of a bucket only grows on mistakes. Snapshots store the sums, so a loaded
+    // model scores and trains on as the saved one.
+    void set_averaged(bool averaged) {
+        averaged_ = averaged;
+        bias_sum_ = 0.0;
+        num_seen_ = 1.0;
+        weight_sums_ = averaged ? Table<double>(weights_.size(), 0.0, weights_.memory()) : Table<double>();
+    }
 
+    // write the model to a snapshot file, see snapshot.hpp
+    void save(const std::string& path) const {
+        SnapshotWriter writer(make_snapshot_header(SnapshotKind::PerceptronFeatureHashing));
+        SnapshotHeader& header = writer.header();
+        header.ngram = ngram_;
+        header.log_num_buckets = log_num_buckets_;
+        header.seed = seed_;
+        header.cell_types = cell_types_code<Weight, Count>();
+        header.learning_rate = learning_rate_;
+        header.bias = bias_;
+        writer.add_table(weights_);
+        writer.add_table(counts_);
+        if (averaged_) {
+            header.bias_sum = bias_sum_;
+            header.num_seen = num_seen_;
+            writer.add_table(weight_sums_);
+        }
+        writer.write(path);
+    }
+
+    // map a snapshot written by save, the model then scores straight from the mapped file
+    static BasicPerceptronFeatureHashing load(const std::string& path) {
+        return BasicPerceptronFeatureHashing(SnapshotReader(path, SnapshotKind::PerceptronFeatureHashing,
+                                                            cell_types_code<Weight, Count>()));
+    }
+
+    // bytes held by the weight and count tables (and the sums of the averaged mode)
+    size_t memory_bytes() const {
+        return weights_.size() * sizeof(Weight) + counts_.size() * sizeof(Count) + weight_sums_.size() * sizeof(double);
+    }
+
+    // occupancy of the tables, see instrumentation.hpp
+    TableStats table_stats() const {
+        size_t nonzero = 0;
+        for (size_t b = 0; b < counts_.size(); ++b)
+            nonzero += count_value(counts_[b]) != 0;
+        return make_table_stats(1, counts_.size(), nonzero);
+    }
+
+private:
+    explicit BasicPerceptronFeatureHashing(const SnapshotReader& snapshot)
+        : BaseClf<BasicPerceptronFeatureHashing>(0.0 /* same threshold as the public constructor */)
+        , ngram_(snapshot.header().ngram)
+        , log_num_buckets_(snapshot.header().log_num_buckets)
+        , learning_rate_(snapshot.header().learning_rate)
+        , bias_(snapshot.header().bias)
+        , weights_(snapshot.template table<Weight>(0))
+        , counts_(snapshot.template table<Count>(1))
+        , seed_(snapshot.header().seed)
+    {
+        size_t num_buckets = static_cast<size_t>(1) << log_num_buckets_;
+        if (weights_.size() != num_buckets || counts_.size() != num_buckets)
+            throw std::runtime_error("corrupt PerceptronFeatureHashing snapshot");
+        if (snapshot.header().num_seen > 0.0) {
+            averaged_ = true;
+            bias_sum_ = snapshot.header().bias_sum;
+            num_seen_ = snapshot.header().num_seen;
+            weight_sums_ = snapshot.template table<double>(2);
+            if (weight_sums_.size() != num_buckets)
+                throw std::runtime_error("corrupt PerceptronFeatureHashing snapshot");
+        }
+    }
+
+    // score with the current weights, as used for training
+    double current_score(const NgramHashes& hashes) const {
         double prediction =0.0;
-         while (emailiter) {
-            std::string_view ngram = emailiter.next(); //iterate through the n grams and extract one at the time 
-            size_t bucket = get_bucket(ngram ); // hash the n-grams to a bucket
-            prediction+=weights_[bucket]*counts_[bucket];
+         for (size_t j = 0; j < hashes.size(); ++j) {
+            size_t bucket = get_bucket(hashes.data()[j]); // map the n-gram hash to a bucket
+            prediction+=hashes.count(j)*weights_[bucket]*count_value(counts_[bucket]);
         }
 
         prediction+=bias_;
@@ -78,7 +222,34 @@ public:
         return prediction;
     }
 
-private:
+    // score with the averaged weights
+    double averaged_score(const NgramHashes& hashes) const {
+        double inv_seen = 1.0 / num_seen_;
+        double prediction = 0.0;
+        for (size_t j = 0; j < hashes.size(); ++j) {
+            size_t bucket = get_bucket(hashes.data()[j]);
+            prediction += hashes.count(j) * (weights_[bucket] - weight_sums_[bucket] * inv_seen) * count_value(counts_[bucket]);
+        }
+        return prediction + bias_ - bias_sum_ * inv_seen;
+    }
+
+    void update_averaged(const NgramHashes& hashes, double error) {
+        if (error != 0) {
+            bias_ += learning_rate_ * error;
+            bias_sum_ += num_seen_ * learning_rate_ * error;
+            for (size_t j = 0; j < hashes.size(); ++j) {
+                size_t bucket = get_bucket(hashes.data()[j]);
+                for (int k = 0; k < hashes.count(j); ++k) {
+                    increment(counts_[bucket]);
+                    Weight delta = static_cast<Weight>(learning_rate_ * error * count_value(counts_[bucket]));
+                    weights_[bucket] += delta;
+                    weight_sums_[bucket] += num_seen_ * delta;
+                }
+            }
+        }
+        num_seen_ += 1.0;
+    }
+
     size_t get_bucket(std::string_view ngram) const
     { return get_bucket(hash(ngram, seed_)); }
 
@@ -86,7 +257,7 @@ private:
         // TODO limit the range of the hash values here
          // first i get the number of buckets from their logarithmic representation using bit manipulation
         size_t num_buckets = 1 << log_num_buckets_;
-        hash=hash%num_buckets; //apply modulo to ensure that the hash value falls into the range of available buckets -> prevent overflow
+        hash=hash&(num_buckets-1); //num_buckets is a power of two, so masking the low bits is the same as the modulo -> prevent overflow
         return hash;
     }
 
@@ -100,4 +271,6 @@ private:
     }
 };
 
+using PerceptronFeatureHashing = BasicPerceptronFeatureHashing<>;
+
 } // namespace bdap
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <ostream>
+#include <type_traits>
+#include <utility>
+#include "email.hpp"
+#include "hashing.hpp"
+#include "metrics.hpp"
+
+namespace bdap {
+
+// metrics of a prequential run at a checkpoint
+struct PrequentialCheckpoint {
+    long long n;              // emails seen so far
+    double seconds;           // since the run started
+    double emails_per_second; // since the previous checkpoint
+    ConfusionMatrix total;    // every email so far
+    ConfusionMatrix window;   // the last window emails
+    FadingConfusionMatrix fading;
+};
+
+// true for the classifiers that can score and train on the same n-gram hashes
+template <typename Clf, typename = void>
+struct has_hash_email : std::false_type {};
+
+template <typename Clf>
+struct has_hash_email<Clf, std::void_t<decltype(std::declval<const Clf&>().hash_email(
+                               std::declval<const Email&>(), std::declval<NgramHashes&>()))>>
+    : std::true_type {};
+
+// Test-then-train (prequential) evaluation of an online classifier: every email
+// is first scored with predict, counted in the metrics, and only then passed to
+// update. The metrics are kept over the whole stream, over a sliding window and
+// with fading weights, and reported every report_every emails together with the
+// throughput. Memory does not depend on the length of the stream.
+//
+// Works with any BaseClf, on Emails or EmailViews, e.g. those of a
+// CorpusReader (see corpus.hpp). The classifiers that provide hash_email hash
+// each email once for both the prediction and the update.
+template <typename Clf>
+class Prequential {
+    using clock = std::chrono::steady_clock;
+
+    Clf& clf_;
+    ConfusionMatrix total_;
+    SlidingConfusionMatrix window_;
+    FadingConfusionMatrix fading_;
+    size_t report_every_;
+    long long n_ = 0;
+    long long last_n_ = 0;
+    clock::time_point start_;
+    clock::time_point last_;
+    NgramHashes hashes_;
+
+public:
+    Prequential(Clf& clf, size_t window = 10000, double alpha = 0.9999, size_t report_every = 100000)
+        : clf_(clf)
+        , window_(window)
+        , fading_(alpha)
+        , report_every_(report_every == 0 ? 1 : report_every)
+        , start_(clock::now())
+        , last_(start_)
+    {}
+
+    // score, count and train on one email (an Email or an EmailView); calls
+    // report(checkpoint) every report_every emails
+    template <typename E, typename Report>
+    void step(const E& email, Report&& report) {
+        bool lab = email.is_spam();
+        bool pred;
+        if constexpr (has_hash_email<Clf>::value) {
+            clf_.hash_email(email, hashes_);
+            pred = clf_.classify(clf_.predict_hashes(hashes_));
+            clf_.update_hashes(hashes_, lab);
+        } else {
+            pred = clf_.classify(clf_.predict(email));
+            clf_.update(email);
+        }
+        total_.add(lab, pred);
+        window_.add(lab, pred);
+        fading_.add(lab, pred);
+        if (++n_ % report_every_ == 0)
+            report(checkpoint());
+    }
+
+    // Runs over a stream: next() returns a pointer to the next email, or nullptr at
+    // the end. The email only has to stay valid until the following call, so a
+    // reader can reuse one buffer, e.g. [&] { return reader.next(); } for a
+    // CorpusReader. Reports a last checkpoint at the end of the stream.
+    template <typename Source, typename Report>
+    long long run(Source&& next, Report&& report) {
+        while (const auto* email = next())
+            step(*email, report);
+        if (n_ != last_n_)
+            report(checkpoint());
+        return n_;
+    }
+
+    long long size() const { return n_; }
+
+    // the metrics now; restarts the throughput measurement
+    PrequentialCheckpoint checkpoint() {
+        clock::time_point now = clock::now();
+        double since_last = std::chrono::duration<double>(now - last_).count();
+        PrequentialCheckpoint c{n_,
+                                std::chrono::duration<double>(now - start_).count(),
+                                since_last > 0 ? (n_ - last_n_) / since_last : 0.0,
+                                total_,
+                                window_.counts(),
+                                fading_};
+        last_ = now;
+        last_n_ = n_;
+        return c;
+    }
+};
+
+// one line per checkpoint: n, seconds, emails/s, then accuracy precision recall F1
+// over the whole stream, the window and the fading metrics
+inline std::ostream& operator<<(std::ostream& out, const PrequentialCheckpoint& c) {
+    auto metrics = [&out](const auto& m) {
+        out << ' ' << m.get_accuracy() << ' ' << m.get_precision()
+            << ' ' << m.get_recall() << ' ' << m.get_F1Score();
+    };
+    out << c.n << ' ' << c.seconds << ' ' << c.emails_per_second;
+    metrics(c.total);
+    metrics(c.window);
+    metrics(c.fading);
+    return out;
+}
+
+} // namespace bdap
@@ -0,0 +1,406 @@
+// Load generator for the ScoringEngine: offered load against throughput and
+// latency.
+//
+// Build (from the top of the repository, see CMakeLists.txt):
+//
+//   cmake -S . -B build && cmake --build build --target scoring_benchmark
+//
+// Run:
+//
+//   ./scoring_benchmark [--classifier nbfh|nbcm|pfh|pcm] [--ngram 3] [--num-hashes 4]
+//                       [--log-buckets 20] [--train-emails N] [--emails N] [--length BYTES]
+//                       [--vocab WORDS] [--signal P] [--seed S]
+//                       [--rates 5000,20000,50000] [--seconds 2] [--clients 16]
+//                       [--front-ends direct,engine,socket] [--workers W] [--max-batch B]
+//                       [--batch-timeout-us T] [--queue-depth D] [--pin 0|1]
+//                       [--socket /tmp/scoring_benchmark.sock] [--out results.json]
+//
+// A classifier is trained on a synthetic stream (see synthetic_stream.hpp),
+// then every front end is driven at every offered rate for --seconds:
+//
+//   direct  --clients threads, each calling predict for its share of the load,
+//           like one filter thread per connection
+//   engine  one thread submitting to a ScoringEngine with try_submit
+//   socket  --clients connections to a ScoringServer, each pipelining its share
+//
+// The load is open loop: email i is due at start + i / rate whether or not the
+// earlier ones are done, and its latency runs from when it was due to when its
+// score is back, so a front end that falls behind shows it in the latency
+// instead of slowing the generator down. Emails the engine refuses because its
+// queue is full are counted as dropped, and count in the latency percentiles
+// as never answered: once more than 1% are dropped the p99 is infinite (null
+// in the JSON). Per front end and rate it reports the achieved throughput,
+// p50/p99/p999 latency over all offered emails, the drops and the mean batch
+// size, as JSON on stdout or in --out.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "email_view.hpp"
+#include "naive_bayes_count_min.hpp"
+#include "naive_bayes_feature_hashing.hpp"
+#include "perceptron_count_min.hpp"
+#include "perceptron_feature_hashing.hpp"
+#include "scoring_engine.hpp"
+#include "scoring_server.hpp"
+#include "synthetic_stream.hpp"
+
+using namespace bdap;
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+struct Options {
+    std::string classifier = "nbcm";
+    int ngram = 3;
+    int num_hashes = 4;
+    int log_buckets = 20;
+    size_t train_emails = 20000;
+    size_t emails = 5000; // distinct emails sent, reused round robin
+    size_t length = 1000;
+    size_t vocab = 50000;
+    double signal = 0.05;
+    unsigned seed = 1;
+    std::vector<double> rates = {5000, 20000, 50000, 100000};
+    double seconds = 2.0;
+    int clients = 16;
+    std::vector<std::string> front_ends = {"direct", "engine", "socket"};
+    ScoringEngineConfig engine;
+    std::string socket = "/tmp/scoring_benchmark.sock";
+    std::string out;
+};
+
+struct Result {
+    std::string front_end;
+    double offered;        // emails per second
+    double achieved;       // emails scored per second
+    size_t dropped;
+    double p50_us;
+    double p99_us;
+    double p999_us;
+    double mean_batch;     // engine and socket only
+};
+
+// the schedule of one run: email i is due at start + i / rate
+struct Schedule {
+    clock_type::time_point start;
+    double rate;
+
+    clock_type::time_point due(size_t i) const {
+        return start + std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(i / rate));
+    }
+};
+
+double micros_since(clock_type::time_point t) {
+    return std::chrono::duration<double, std::micro>(clock_type::now() - t).count();
+}
+
+// latencies[i] of email i, negative for the emails that were dropped; the
+// percentiles are over all of them, a dropped one taking infinitely long
+Result summarize(const std::string& front_end, double rate, std::vector<double>& latencies, double seconds,
+                 double mean_batch)
+{
+    std::vector<double> all;
+    size_t dropped = 0;
+    for (double l : latencies) {
+        dropped += l < 0;
+        all.push_back(l < 0 ? INFINITY : l);
+    }
+    std::sort(all.begin(), all.end());
+    auto pct = [&all](double p) {
+        return all.empty() ? NAN : all[std::min(all.size() - 1, static_cast<size_t>(p * all.size()))];
+    };
+    size_t done = latencies.size() - dropped;
+    return Result{front_end, rate, seconds > 0 ? done / seconds : 0.0, dropped,
+                  pct(0.5), pct(0.99), pct(0.999), mean_batch};
+}
+
+template <typename Clf>
+Result run_direct(const Clf& clf, const Stream& stream, double rate, size_t n, int clients) {
+    std::vector<double> latencies(n, -1.0);
+    std::vector<double> scores(n);
+    Schedule schedule{clock_type::now() + std::chrono::milliseconds(10), rate};
+    std::vector<std::thread> threads;
+    for (int c = 0; c < clients; ++c) {
+        threads.emplace_back([&, c] {
+            for (size_t i = c; i < n; i += clients) {
+                std::this_thread::sleep_until(schedule.due(i));
+                scores[i] = clf.predict(stream.emails[i % stream.emails.size()]);
+                latencies[i] = micros_since(schedule.due(i));
+            }
+        });
+    }
+    for (std::thread& t : threads)
+        t.join();
+    double seconds = std::chrono::duration<double>(clock_type::now() - schedule.start).count();
+    return summarize("direct", rate, latencies, seconds, 1.0);
+}
+
+template <typename Clf>
+Result run_engine(ScoringEngine<Clf>& engine, const Stream& stream, double rate, size_t n) {
+    std::vector<double> latencies(n, -1.0);
+    std::atomic<size_t> remaining{n};
+    uint64_t emails0 = engine.emails_scored();
+    uint64_t batches0 = engine.batches_scored();
+    Schedule schedule{clock_type::now() + std::chrono::milliseconds(10), rate};
+    for (size_t i = 0; i < n; ++i) {
+        std::this_thread::sleep_until(schedule.due(i));
+        bool queued = engine.try_submit(std::string(stream.emails[i % stream.emails.size()].body()),
+                                        [&latencies, &remaining, &schedule, i](double) {
+                                            latencies[i] = micros_since(schedule.due(i));
+                                            remaining.fetch_sub(1);
+                                        });
+        if (!queued)
+            remaining.fetch_sub(1);
+    }
+    while (remaining.load() != 0)
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+    double seconds = std::chrono::duration<double>(clock_type::now() - schedule.start).count();
+    uint64_t batches = engine.batches_scored() - batches0;
+    double mean_batch = batches == 0 ? 0.0 : static_cast<double>(engine.emails_scored() - emails0) / batches;
+    return summarize("engine", rate, latencies, seconds, mean_batch);
+}
+
+int connect_unix(const std::string& path) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        if (fd >= 0)
+            ::close(fd);
+        throw std::runtime_error("cannot connect to " + path);
+    }
+    return fd;
+}
+
+// every connection has a sender that writes its emails when they are due and a
+// receiver that reads the answers, which come back in the order of the emails
+template <typename Clf>
+Result run_socket(ScoringEngine<Clf>& engine, const std::string& path, const Stream& stream, double rate,
+                  size_t n, int clients)
+{
+    std::vector<int> fds;
+    for (int c = 0; c < clients; ++c)
+        fds.push_back(connect_unix(path));
+
+    std::vector<double> latencies(n, -1.0);
+    uint64_t emails0 = engine.emails_scored();
+    uint64_t batches0 = engine.batches_scored();
+    Schedule schedule{clock_type::now() + std::chrono::milliseconds(10), rate};
+    std::vector<std::thread> threads;
+    for (int c = 0; c < clients; ++c) {
+        int fd = fds[c];
+        threads.emplace_back([&, c, fd] {
+            std::thread receiver([&, c, fd] {
+                size_t next = c;
+                char buf[1 << 14];
+                while (next < n) {
+                    ssize_t r = ::read(fd, buf, sizeof(buf));
+                    if (r <= 0)
+                        break;
+                    for (ssize_t k = 0; k < r; ++k) {
+                        if (buf[k] == '\n') {
+                            latencies[next] = micros_since(schedule.due(next));
+                            next += clients;
+                        }
+                    }
+                }
+            });
+            std::string line;
+            for (size_t i = c; i < n; i += clients) {
+                std::this_thread::sleep_until(schedule.due(i));
+                line.assign(stream.emails[i % stream.emails.size()].body());
+                line += '\n';
+                for (size_t done = 0; done < line.size(); ) {
+                    ssize_t w = ::send(fd, line.data() + done, line.size() - done, MSG_NOSIGNAL);
+                    if (w <= 0)
+                        break;
+                    done += static_cast<size_t>(w);
+                }
+            }
+            receiver.join();
+            ::close(fd);
+        });
+    }
+    for (std::thread& t : threads)
+        t.join();
+    double seconds = std::chrono::duration<double>(clock_type::now() - schedule.start).count();
+    uint64_t batches = engine.batches_scored() - batches0;
+    double mean_batch = batches == 0 ? 0.0 : static_cast<double>(engine.emails_scored() - emails0) / batches;
+    return summarize("socket", rate, latencies, seconds, mean_batch);
+}
+
+template <typename Clf>
+std::vector<Result> run_all(Clf clf, const Options& o, const Stream& train, const Stream& test) {
+    for (const EmailView& email : train.emails)
+        clf.update(email);
+
+    std::vector<Result> results;
+    std::unique_ptr<ScoringEngine<Clf>> engine;
+    std::unique_ptr<ScoringServer<Clf>> server;
+    for (const std::string& front_end : o.front_ends) {
+        if (front_end != "direct" && !engine)
+            engine.reset(new ScoringEngine<Clf>(clf, o.engine));
+        if (front_end == "socket" && !server)
+            server.reset(new ScoringServer<Clf>(*engine, o.socket));
+        for (double rate : o.rates) {
+            size_t n = static_cast<size_t>(rate * o.seconds);
+            if (front_end == "direct")
+                results.push_back(run_direct(clf, test, rate, n, o.clients));
+            else if (front_end == "engine")
+                results.push_back(run_engine(*engine, test, rate, n));
+            else if (front_end == "socket")
+                results.push_back(run_socket(*engine, o.socket, test, rate, n, o.clients));
+            else
+                throw std::invalid_argument("unknown front end " + front_end);
+        }
+    }
+    return results;
+}
+
+std::vector<std::string> parse_names(const std::string& s) {
+    std::vector<std::string> v;
+    std::stringstream in(s);
+    std::string item;
+    while (std::getline(in, item, ','))
+        v.push_back(item);
+    return v;
+}
+
+std::vector<double> parse_doubles(const std::string& s) {
+    std::vector<double> v;
+    for (const std::string& item : parse_names(s))
+        v.push_back(std::stod(item));
+    return v;
+}
+
+Options parse_options(int argc, char** argv) {
+    Options o;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc)
+            throw std::invalid_argument("missing value for " + arg);
+        std::string value = argv[++i];
+        if (arg == "--classifier") o.classifier = value;
+        else if (arg == "--ngram") o.ngram = std::stoi(value);
+        else if (arg == "--num-hashes") o.num_hashes = std::stoi(value);
+        else if (arg == "--log-buckets") o.log_buckets = std::stoi(value);
+        else if (arg == "--train-emails") o.train_emails = std::stoul(value);
+        else if (arg == "--emails") o.emails = std::max<size_t>(std::stoul(value), 1);
+        else if (arg == "--length") o.length = std::stoul(value);
+        else if (arg == "--vocab") o.vocab = std::stoul(value);
+        else if (arg == "--signal") o.signal = std::stod(value);
+        else if (arg == "--seed") o.seed = static_cast<unsigned>(std::stoul(value));
+        else if (arg == "--rates") o.rates = parse_doubles(value);
+        else if (arg == "--seconds") o.seconds = std::stod(value);
+        else if (arg == "--clients") o.clients = std::max(std::stoi(value), 1);
+        else if (arg == "--front-ends") o.front_ends = parse_names(value);
+        else if (arg == "--workers") o.engine.num_workers = std::stoi(value);
+        else if (arg == "--max-batch") o.engine.max_batch = std::stoul(value);
+        else if (arg == "--batch-timeout-us") o.engine.batch_timeout = std::chrono::microseconds(std::stol(value));
+        else if (arg == "--queue-depth") o.engine.queue_depth = std::stoul(value);
+        else if (arg == "--pin") o.engine.pin_workers = std::stoi(value) != 0;
+        else if (arg == "--socket") o.socket = value;
+        else if (arg == "--out") o.out = value;
+        else throw std::invalid_argument("unknown option " + arg);
+    }
+    return o;
+}
+
+// JSON numbers cannot be nan or inf
+std::string json_number(double x) {
+    if (!std::isfinite(x))
+        return "null";
+    std::ostringstream out;
+    out.precision(6);
+    out << x;
+    return out.str();
+}
+
+void write_json(std::ostream& out, const Options& o, const std::vector<Result>& results) {
+    out << "{\n  \"config\": {\"classifier\": \"" << o.classifier << "\", \"ngram\": " << o.ngram
+        << ", \"num_hashes\": " << o.num_hashes << ", \"log_num_buckets\": " << o.log_buckets
+        << ", \"length\": " << o.length << ", \"clients\": " << o.clients
+        << ", \"workers\": " << o.engine.num_workers << ", \"max_batch\": " << o.engine.max_batch
+        << ", \"batch_timeout_us\": " << o.engine.batch_timeout.count()
+        << ", \"queue_depth\": " << o.engine.queue_depth
+        << ", \"pin\": " << (o.engine.pin_workers ? "true" : "false") << ", \"seed\": " << o.seed << "},\n";
+    out << "  \"results\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        out << (i ? ",\n" : "\n") << "    {\"front_end\": \"" << r.front_end << "\""
+            << ", \"offered\": " << json_number(r.offered)
+            << ", \"achieved\": " << json_number(r.achieved)
+            << ", \"dropped\": " << r.dropped
+            << ", \"p50_us\": " << json_number(r.p50_us)
+            << ", \"p99_us\": " << json_number(r.p99_us)
+            << ", \"p999_us\": " << json_number(r.p999_us)
+            << ", \"mean_batch\": " << json_number(r.mean_batch) << "}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Options o;
+    try {
+        o = parse_options(argc, argv);
+    } catch (const std::exception& e) {
+        std::cerr << "scoring_benchmark: " << e.what() << "\n";
+        return 2;
+    }
+
+    std::mt19937_64 rng(o.seed);
+    StreamGenerator generator(o.vocab, o.signal, rng);
+    Stream train = generator.generate(o.train_emails, o.length, 1, 0, 0, rng);
+    Stream test = generator.generate(o.emails, o.length, 1, 0, 0, rng);
+
+    std::vector<Result> results;
+    try {
+        if (o.classifier == "nbfh")
+            results = run_all(NaiveBayesFeatureHashing(o.ngram, o.log_buckets), o, train, test);
+        else if (o.classifier == "nbcm")
+            results = run_all(NaiveBayesCountMin(o.ngram, o.num_hashes, o.log_buckets), o, train, test);
+        else if (o.classifier == "pfh")
+            results = run_all(PerceptronFeatureHashing(o.ngram, o.log_buckets, 0.01), o, train, test);
+        else if (o.classifier == "pcm")
+            results = run_all(PerceptronCountMin(o.ngram, o.num_hashes, o.log_buckets, 0.01), o, train, test);
+        else
+            throw std::invalid_argument("unknown classifier " + o.classifier);
+    } catch (const std::exception& e) {
+        std::cerr << "scoring_benchmark: " << e.what() << "\n";
+        return 1;
+    }
+
+    if (o.out.empty()) {
+        write_json(std::cout, o, results);
+    } else {
+        std::ofstream out(o.out);
+        write_json(out, o, results);
+        if (!out) {
+            std::cerr << "scoring_benchmark: cannot write " << o.out << "\n";
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,231 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include "email_view.hpp"
+#include "parallel.hpp"
+
+// In-process scoring service for a filter that gets bursts of emails from many
+// connections. Instead of every connection thread calling predict on its own
+// (each on a cold cache, and with as many threads in the tables as there are
+// connections), the emails are queued and a fixed pool of workers, each pinned
+// to a core, takes them off the queue in batches and scores a batch with
+// predict_batch (see batch.hpp), so the hashing of the batch is done up
+// front. The result goes back through a callback or a future.
+//
+// A worker scores as soon as max_batch emails are waiting, or when the oldest
+// waiting email has waited batch_timeout, so under light load an email waits
+// at most batch_timeout for company, and under heavy load the batches fill up
+// by themselves. At most queue_depth emails wait: submit then blocks and
+// try_submit refuses, so a burst larger than the service can take turns into
+// back pressure on the connections instead of unbounded latency.
+//
+// Works with the four classifiers (anything with BaseClf::predict_batch). The
+// model is only read; it must not be trained while the engine runs, score a
+// copy or a published snapshot instead.
+namespace bdap {
+
+struct ScoringEngineConfig {
+    int num_workers = 0;                          // 0 = one per core
+    size_t max_batch = 64;                        // emails scored together at most
+    std::chrono::microseconds batch_timeout{200}; // longest an email waits for its batch to fill
+    size_t queue_depth = 4096;                    // emails waiting at most
+    bool pin_workers = true;                      // worker w runs on core (first_core + w) % cores
+    int first_core = 0;
+};
+
+template <typename Clf>
+class ScoringEngine {
+public:
+    // gets the score; runs on a worker thread, so it should be short. An
+    // exception it throws is caught and counted (callback_errors), the rest of
+    // the batch still gets its scores.
+    using Callback = std::function<void(double)>;
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    struct Request {
+        std::string body;
+        Callback done;
+        clock::time_point due; // the batch goes by then, full or not
+    };
+
+    const Clf& clf_;
+    ScoringEngineConfig config_;
+
+    std::mutex mutex_;
+    std::condition_variable waiting_;  // workers wait for emails
+    std::condition_variable has_room_; // submit waits for room in the queue
+    std::deque<Request> queue_;
+    bool stopping_ = false;
+    std::vector<std::thread> workers_;
+
+    std::atomic<uint64_t> emails_scored_{0};
+    std::atomic<uint64_t> batches_scored_{0};
+    std::atomic<uint64_t> callback_errors_{0};
+
+public:
+    ScoringEngine(const Clf& clf, const ScoringEngineConfig& config = ScoringEngineConfig())
+        : clf_(clf)
+        , config_(config)
+    {
+        if (config_.num_workers <= 0)
+            config_.num_workers = default_num_threads();
+        config_.max_batch = std::max<size_t>(config_.max_batch, 1);
+        config_.queue_depth = std::max(config_.queue_depth, config_.max_batch);
+        for (int w = 0; w < config_.num_workers; ++w) {
+            workers_.emplace_back([this] { work(); });
+            if (config_.pin_workers)
+                pin_to_core(workers_.back(), (config_.first_core + w) % default_num_threads());
+        }
+    }
+
+    // scores what is still queued, then stops the workers
+    ~ScoringEngine() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        waiting_.notify_all();
+        has_room_.notify_all();
+        for (std::thread& t : workers_)
+            t.join();
+    }
+
+    ScoringEngine(const ScoringEngine&) = delete;
+    ScoringEngine& operator=(const ScoringEngine&) = delete;
+
+    // Queue an email body, waits while the queue is full. Throws runtime_error once
+    // the engine is being destroyed, as nothing would score the email any more.
+    void submit(std::string body, Callback done) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        has_room_.wait(lock, [this] { return stopping_ || queue_.size() < config_.queue_depth; });
+        if (stopping_)
+            throw std::runtime_error("ScoringEngine: submit while stopping");
+        push(lock, std::move(body), std::move(done));
+    }
+
+    // like submit, but returns false instead of waiting when the queue is full,
+    // and once the engine is being destroyed
+    bool try_submit(std::string body, Callback done) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (stopping_ || queue_.size() >= config_.queue_depth)
+            return false;
+        push(lock, std::move(body), std::move(done));
+        return true;
+    }
+
+    std::future<double> submit(std::string body) {
+        auto promise = std::make_shared<std::promise<double>>();
+        std::future<double> score = promise->get_future();
+        submit(std::move(body), [promise](double s) { promise->set_value(s); });
+        return score;
+    }
+
+    const Clf& model() const { return clf_; }
+    const ScoringEngineConfig& config() const { return config_; }
+
+    uint64_t emails_scored() const { return emails_scored_.load(std::memory_order_relaxed); }
+    uint64_t batches_scored() const { return batches_scored_.load(std::memory_order_relaxed); }
+    uint64_t callback_errors() const { return callback_errors_.load(std::memory_order_relaxed); }
+
+    double mean_batch_size() const {
+        uint64_t b = batches_scored();
+        return b == 0 ? 0.0 : static_cast<double>(emails_scored()) / b;
+    }
+
+private:
+    void push(std::unique_lock<std::mutex>& lock, std::string body, Callback done) {
+        queue_.push_back(Request{std::move(body), std::move(done), clock::now() + config_.batch_timeout});
+        // a worker only needs waking for the first email and for a full batch
+        bool wake = queue_.size() == 1 || queue_.size() >= config_.max_batch;
+        lock.unlock();
+        if (wake)
+            waiting_.notify_one();
+    }
+
+    void work() {
+        std::vector<Request> batch;
+        std::vector<EmailView> views;
+        std::vector<double> scores;
+        batch.reserve(config_.max_batch);
+
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                waiting_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+                if (queue_.empty())
+                    return; // stopping, and nothing left to score
+                // wait for a full batch until the oldest email is due
+                while (!stopping_ && !queue_.empty() && queue_.size() < config_.max_batch) {
+                    clock::time_point due = queue_.front().due;
+                    if (clock::now() >= due)
+                        break;
+                    waiting_.wait_until(lock, due);
+                }
+                if (queue_.empty())
+                    continue; // another worker took them
+                size_t n = std::min(queue_.size(), config_.max_batch);
+                for (size_t i = 0; i < n; ++i) {
+                    batch.push_back(std::move(queue_.front()));
+                    queue_.pop_front();
+                }
+                if (!queue_.empty())
+                    waiting_.notify_one();
+            }
+            has_room_.notify_all();
+
+            views.clear();
+            for (const Request& r : batch)
+                views.emplace_back(false, r.body);
+            scores.resize(batch.size());
+            clf_.predict_batch(views.data(), views.size(), scores.data());
+            for (size_t i = 0; i < batch.size(); ++i) {
+                // an exception must not end the worker, nor skip the others
+                try {
+                    batch[i].done(scores[i]);
+                } catch (...) {
+                    callback_errors_.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+
+            emails_scored_.fetch_add(batch.size(), std::memory_order_relaxed);
+            batches_scored_.fetch_add(1, std::memory_order_relaxed);
+            batch.clear();
+        }
+    }
+
+    // only a hint, errors are ignored
+    static void pin_to_core(std::thread& t, int core) {
+#if defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(core, &set);
+        pthread_setaffinity_np(t.native_handle(), sizeof(set), &set);
+#else
+        (void)t;
+        (void)core;
+#endif
+    }
+};
+
+} // namespace bdap
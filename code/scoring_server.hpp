@@ -0,0 +1,171 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "scoring_engine.hpp"
+
+// Unix socket front-end of a ScoringEngine, for testing the engine from other
+// processes and for load generation (see scoring_benchmark.cpp). The protocol
+// is line based: the client writes email bodies, one per line, and gets one
+// line "<score> <0|1>" back per email, in order, 1 meaning spam by the
+// classifier's threshold. Each connection has its own thread, which ends with
+// the connection; all lines that have arrived on a connection are submitted
+// before the first answer is awaited, so a client that pipelines its emails
+// gets them batched with each other and with those of the other connections.
+// The server has to go before its engine.
+//
+//   ScoringEngine<NaiveBayesCountMin> engine(model);
+//   ScoringServer<NaiveBayesCountMin> server(engine, "/run/spam-filter.sock");
+//
+//   $ printf 'buy cheap pills now\n' | nc -U /run/spam-filter.sock
+namespace bdap {
+
+template <typename Clf>
+class ScoringServer {
+    ScoringEngine<Clf>& engine_;
+    std::string path_;
+    int listen_fd_ = -1;
+    std::atomic<bool> stopping_{false};
+    std::thread acceptor_;
+
+    // the connection threads are detached, the destructor waits for live_ to drop to 0
+    std::mutex mutex_;
+    std::condition_variable closed_;
+    size_t live_ = 0;
+    std::vector<int> open_fds_; // of the connections still being served
+
+public:
+    // listens on path, replacing a stale socket file there
+    ScoringServer(ScoringEngine<Clf>& engine, const std::string& path)
+        : engine_(engine)
+        , path_(path)
+    {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (path_.size() >= sizeof(addr.sun_path))
+            throw std::runtime_error("socket path too long: " + path_);
+        std::memcpy(addr.sun_path, path_.c_str(), path_.size() + 1);
+
+        listen_fd_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listen_fd_ < 0)
+            throw std::runtime_error("cannot create socket: " + path_);
+        ::unlink(path_.c_str());
+        if (::bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0
+            || ::listen(listen_fd_, SOMAXCONN) != 0) {
+            ::close(listen_fd_);
+            throw std::runtime_error("cannot listen on socket: " + path_);
+        }
+        acceptor_ = std::thread([this] { accept_loop(); });
+    }
+
+    // closes all connections, waits for their threads and removes the socket file
+    ~ScoringServer() {
+        stopping_.store(true);
+        ::shutdown(listen_fd_, SHUT_RDWR);
+        acceptor_.join();
+        ::close(listen_fd_);
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            for (int fd : open_fds_)
+                ::shutdown(fd, SHUT_RDWR);
+            closed_.wait(lock, [this] { return live_ == 0; });
+        }
+        ::unlink(path_.c_str());
+    }
+
+    ScoringServer(const ScoringServer&) = delete;
+    ScoringServer& operator=(const ScoringServer&) = delete;
+
+    const std::string& path() const { return path_; }
+
+    // connections being served right now
+    size_t num_connections() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return live_;
+    }
+
+private:
+    void accept_loop() {
+        while (!stopping_.load()) {
+            int fd = ::accept(listen_fd_, nullptr, nullptr);
+            if (fd < 0) {
+                if (stopping_.load())
+                    return;
+                continue;
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            open_fds_.push_back(fd);
+            ++live_;
+            std::thread([this, fd] { serve(fd); }).detach();
+        }
+    }
+
+    void serve(int fd) {
+        std::string in;
+        std::string out;
+        std::deque<std::future<double>> pending;
+        char buf[1 << 16];
+        for (;;) {
+            ssize_t r = ::read(fd, buf, sizeof(buf));
+            if (r <= 0)
+                break;
+            in.append(buf, static_cast<size_t>(r));
+
+            size_t begin = 0;
+            out.clear();
+            try {
+                for (size_t end; (end = in.find('\n', begin)) != std::string::npos; begin = end + 1)
+                    pending.push_back(engine_.submit(in.substr(begin, end - begin)));
+                for (; !pending.empty(); pending.pop_front()) {
+                    double score = pending.front().get();
+                    char line[64];
+                    std::snprintf(line, sizeof(line), "%.9g %d\n", score, engine_.model().classify(score) ? 1 : 0);
+                    out += line;
+                }
+            } catch (const std::exception&) {
+                break; // the engine is stopping
+            }
+            in.erase(0, begin);
+            if (!write_all(fd, out))
+                break;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t i = 0; i < open_fds_.size(); ++i) {
+            if (open_fds_[i] == fd) {
+                open_fds_.erase(open_fds_.begin() + i);
+                break;
+            }
+        }
+        ::close(fd);
+        --live_;
+        // under the lock: the destructor gets it only after this thread is done with the server
+        closed_.notify_all();
+    }
+
+    static bool write_all(int fd, const std::string& s) {
+        size_t done = 0;
+        while (done < s.size()) {
+            ssize_t w = ::send(fd, s.data() + done, s.size() - done, MSG_NOSIGNAL);
+            if (w <= 0)
+                return false;
+            done += static_cast<size_t>(w);
+        }
+        return true;
+    }
+};
+
+} // namespace bdap
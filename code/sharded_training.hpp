@@ -0,0 +1,49 @@
+#pragma once
+
+#include <algorithm>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+#include "email.hpp"
+#include "parallel.hpp"
+
+namespace bdap {
+
+// Trains model on emails with num_threads threads (0 = one per core). Every
+// thread trains a private replica on its contiguous share of the stream and
+// merges it into model after every merge_every emails (0 = only at the end).
+//
+// Works for classifiers whose update only adds counts, i.e. that provide
+// merge(const Clf&) and clear(): NaiveBayesCountMin and
+// NaiveBayesFeatureHashing. The result is the same as training model serially;
+// the configurations where it would not be (see merges_exactly) are rejected.
+template <typename Clf>
+void train_sharded(Clf& model, const std::vector<Email>& emails, int num_threads = 0,
+                   size_t merge_every = 0)
+{
+    if (!model.merges_exactly())
+        throw std::invalid_argument("train_sharded: the model's counts do not merge exactly");
+
+    // the replicas start empty but with the parameters of model
+    Clf empty = model;
+    empty.clear();
+
+    std::mutex model_mutex;
+    parallel_chunks(emails.size(), num_threads, [&](int, size_t begin, size_t end) {
+        Clf replica = empty;
+        size_t step = merge_every == 0 ? end - begin : merge_every;
+
+        for (size_t i = begin; i < end; ) {
+            size_t stop = std::min(end, i + step);
+            for (; i < stop; ++i)
+                replica.update(emails[i]);
+
+            std::lock_guard<std::mutex> lock(model_mutex);
+            model.merge(replica);
+            if (i < end)
+                replica.clear();
+        }
+    });
+}
+
+} // namespace bdap
@@ -0,0 +1,280 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+#include <vector>
+#include "count_min_sketch.hpp"
+#include "counters.hpp"
+#include "hashing.hpp"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define BDAP_HAVE_AVX2_KERNELS 1
+#include <immintrin.h>
+#else
+#define BDAP_HAVE_AVX2_KERNELS 0
+#endif
+
+// Count-Min query kernels: for a block of n-gram hashes, gather the cell of
+// every row and reduce them to a min (naive bayes) or a median (perceptron).
+// There is a scalar version and an AVX2 version that handles 8 (min) or 4
+// (median) n-grams at a time with vector gathers and gives the same results;
+// the AVX2 version is picked at runtime when the CPU supports it, so one binary
+// runs everywhere. The AVX2 versions cover the default cell types (int counts,
+// double weight/count pairs); other cell types always take the scalar path.
+// The count-mean-min estimate only has a scalar version.
+//
+// Every kernel takes the number of rows as an optional template argument
+// Rows; with Rows != 0 it must equal cms.num_rows() and the loops over the
+// rows are unrolled. Rows = 0 reads the row count at runtime.
+namespace bdap {
+namespace kernels {
+
+// the AVX2 median sorts the rows with a sorting network, up to this many rows
+constexpr int max_simd_median_rows = 16;
+
+// the gathers use 32 bit offsets, counted in ints or doubles
+constexpr int max_simd_log_num_buckets = 29;
+
+// number of n-grams the classifiers hand to a kernel at once
+constexpr size_t block_size = 64;
+
+// number of rows of cms, a compile time constant when Rows != 0
+template <int Rows, typename Sketch>
+int num_rows(const Sketch& cms) {
+    return Rows != 0 ? Rows : cms.num_rows();
+}
+
+inline bool cpu_has_avx2() {
+#if BDAP_HAVE_AVX2_KERNELS
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    return has_avx2;
+#else
+    return false;
+#endif
+}
+
+// the count of a cell as an int; the counts of float cells and the estimates of
+// Morris cells can be out of range for int, where static_cast is undefined, so
+// they saturate
+template <typename T>
+int count_as_int(const T& cell) {
+    auto c = count_value(cell);
+    if (c >= std::numeric_limits<int>::max())
+        return std::numeric_limits<int>::max();
+    if (c <= std::numeric_limits<int>::min())
+        return std::numeric_limits<int>::min();
+    return static_cast<int>(c);
+}
+
+// min over the rows of both values of the cells of each n-gram
+template <int Rows = 0, typename Count>
+void min_rows_scalar(const CountMinSketch<Count>& cms, const RowHasher& hasher,
+                     const size_t* hashes, size_t n, int* min_first, int* min_second)
+{
+    int k = num_rows<Rows>(cms);
+    for (size_t j = 0; j < n; ++j) {
+        RowHasher::Probe probe = hasher.probe(hashes[j]);
+        int a = std::numeric_limits<int>::max();
+        int b = std::numeric_limits<int>::max();
+        for (int i = 0; i < k; ++i) {
+            const auto& cell = cms.at(i, hasher.bucket(probe, i));
+            a = std::min(a, count_as_int(cell.first));
+            b = std::min(b, count_as_int(cell.second));
+        }
+        min_first[j] = a;
+        min_second[j] = b;
+    }
+}
+
+// median over the rows of the weights (first value) of each n-gram, and the sum
+// over the rows of its counts (second value), which the perceptron multiplies
+// with it; for an even number of rows the two middle weights are averaged
+template <int Rows = 0, typename Weight, typename Count>
+void median_rows_scalar(const CountMinSketch<Weight, Count>& cms, const RowHasher& hasher,
+                        const size_t* hashes, size_t n, double* median, double* count_sum)
+{
+    int k = num_rows<Rows>(cms);
+    double weight[max_simd_median_rows];
+    std::vector<double> large; // only used for more rows than fit in weight
+    double* w = weight;
+    if (k > max_simd_median_rows) {
+        large.resize(k);
+        w = large.data();
+    }
+
+    for (size_t j = 0; j < n; ++j) {
+        RowHasher::Probe probe = hasher.probe(hashes[j]);
+        double c = 0.0;
+        for (int i = 0; i < k; ++i) {
+            const auto& cell = cms.at(i, hasher.bucket(probe, i));
+            w[i] = static_cast<double>(cell.first);
+            c += static_cast<double>(count_value(cell.second));
+        }
+        std::sort(w, w + k);
+        median[j] = k % 2 == 0 ? (w[k / 2 - 1] + w[k / 2]) / 2 : w[k / 2];
+        count_sum[j] = c;
+    }
+}
+
+// count-mean-min estimate of both values of the cells of each n-gram. Per row the
+// count c has the other N - c occurrences of that row spread over w - 1 buckets,
+// so c - (N - c) / (w - 1) removes the expected collision noise; the estimate is
+// the median of that over the rows, clamped to [0, min]. row_total_* is N, the
+// number of occurrences added to each row.
+template <int Rows = 0, typename Count>
+void count_mean_min_rows(const CountMinSketch<Count>& cms, const RowHasher& hasher,
+                         const size_t* hashes, size_t n, double row_total_first, double row_total_second,
+                         double* est_first, double* est_second)
+{
+    int k = num_rows<Rows>(cms);
+    double a[max_simd_median_rows];
+    double b[max_simd_median_rows];
+    std::vector<double> large; // only used for more rows than fit in a and b
+    double* x = a;
+    double* y = b;
+    if (k > max_simd_median_rows) {
+        large.resize(2 * k);
+        x = large.data();
+        y = large.data() + k;
+    }
+    double noise = cms.num_buckets() > 1 ? 1.0 / (cms.num_buckets() - 1) : 0.0;
+    auto median = [k](double* v) {
+        std::sort(v, v + k);
+        return k % 2 == 0 ? (v[k / 2 - 1] + v[k / 2]) / 2 : v[k / 2];
+    };
+
+    for (size_t j = 0; j < n; ++j) {
+        RowHasher::Probe probe = hasher.probe(hashes[j]);
+        double min_a = std::numeric_limits<double>::max();
+        double min_b = std::numeric_limits<double>::max();
+        for (int i = 0; i < k; ++i) {
+            const auto& cell = cms.at(i, hasher.bucket(probe, i));
+            double c = static_cast<double>(count_value(cell.first));
+            double d = static_cast<double>(count_value(cell.second));
+            x[i] = c - (row_total_first - c) * noise;
+            y[i] = d - (row_total_second - d) * noise;
+            min_a = std::min(min_a, c);
+            min_b = std::min(min_b, d);
+        }
+        est_first[j] = std::clamp(median(x), 0.0, min_a);
+        est_second[j] = std::clamp(median(y), 0.0, min_b);
+    }
+}
+
+#if BDAP_HAVE_AVX2_KERNELS
+
+template <int Rows = 0>
+__attribute__((target("avx2")))
+inline void min_rows_avx2(const CountMinSketch<int>& cms, const RowHasher& hasher,
+                          const size_t* hashes, size_t n, int* min_first, int* min_second)
+{
+    int k = num_rows<Rows>(cms);
+    size_t j = 0;
+    for (; j + 8 <= n; j += 8) {
+        RowHasher::Probe probe[8];
+        for (int l = 0; l < 8; ++l)
+            probe[l] = hasher.probe(hashes[j + l]);
+
+        __m256i a = _mm256_set1_epi32(std::numeric_limits<int>::max());
+        __m256i b = a;
+        for (int i = 0; i < k; ++i) {
+            alignas(32) int32_t bucket[8];
+            for (int l = 0; l < 8; ++l)
+                bucket[l] = static_cast<int32_t>(hasher.bucket(probe[l], i));
+            __m256i idx = _mm256_load_si256(reinterpret_cast<const __m256i*>(bucket));
+
+            // a cell is two ints, so scale 8 steps over whole cells
+            const int* row = &cms.at(i, 0).first;
+            a = _mm256_min_epi32(a, _mm256_i32gather_epi32(row, idx, 8));
+            b = _mm256_min_epi32(b, _mm256_i32gather_epi32(row + 1, idx, 8));
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(min_first + j), a);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(min_second + j), b);
+    }
+    min_rows_scalar<Rows>(cms, hasher, hashes + j, n - j, min_first + j, min_second + j);
+}
+
+template <int Rows = 0>
+__attribute__((target("avx2")))
+inline void median_rows_avx2(const CountMinSketch<double>& cms, const RowHasher& hasher,
+                             const size_t* hashes, size_t n, double* median, double* count_sum)
+{
+    int k = num_rows<Rows>(cms);
+    if (k > max_simd_median_rows) {
+        median_rows_scalar<Rows>(cms, hasher, hashes, n, median, count_sum);
+        return;
+    }
+
+    size_t j = 0;
+    for (; j + 4 <= n; j += 4) {
+        RowHasher::Probe probe[4];
+        for (int l = 0; l < 4; ++l)
+            probe[l] = hasher.probe(hashes[j + l]);
+
+        // v[i] holds the weight of row i for the 4 n-grams, c the sum of their counts
+        __m256d v[max_simd_median_rows];
+        __m256d c = _mm256_setzero_pd();
+        // the masked gathers with a zero source load all 4 lanes like the
+        // plain ones, without reading an undefined source register
+        const __m256d zero = _mm256_setzero_pd();
+        const __m256d all = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+        for (int i = 0; i < k; ++i) {
+            alignas(16) int32_t bucket[4];
+            for (int l = 0; l < 4; ++l)
+                bucket[l] = static_cast<int32_t>(hasher.bucket(probe[l], i) * 2); // a cell is two doubles
+            const double* row = &cms.at(i, 0).first;
+            __m128i idx = _mm_load_si128(reinterpret_cast<const __m128i*>(bucket));
+            v[i] = _mm256_mask_i32gather_pd(zero, row, idx, all, 8);
+            c = _mm256_add_pd(c, _mm256_mask_i32gather_pd(zero, row + 1, idx, all, 8));
+        }
+
+        // odd-even transposition sort across the rows, branch free
+        for (int round = 0; round < k; ++round) {
+            for (int i = round % 2; i + 1 < k; i += 2) {
+                __m256d lo = _mm256_min_pd(v[i], v[i + 1]);
+                v[i + 1] = _mm256_max_pd(v[i], v[i + 1]);
+                v[i] = lo;
+            }
+        }
+
+        __m256d m = k % 2 == 0 ? _mm256_mul_pd(_mm256_add_pd(v[k / 2 - 1], v[k / 2]), _mm256_set1_pd(0.5))
+                               : v[k / 2];
+        _mm256_storeu_pd(median + j, m);
+        _mm256_storeu_pd(count_sum + j, c);
+    }
+    median_rows_scalar<Rows>(cms, hasher, hashes + j, n - j, median + j, count_sum + j);
+}
+
+#endif
+
+template <int Rows = 0, typename Count>
+void min_rows(const CountMinSketch<Count>& cms, const RowHasher& hasher,
+              const size_t* hashes, size_t n, int* min_first, int* min_second)
+{
+#if BDAP_HAVE_AVX2_KERNELS
+    if constexpr (std::is_same<Count, int>::value) {
+        if (cpu_has_avx2() && cms.log_num_buckets() <= max_simd_log_num_buckets)
+            return min_rows_avx2<Rows>(cms, hasher, hashes, n, min_first, min_second);
+    }
+#endif
+    min_rows_scalar<Rows>(cms, hasher, hashes, n, min_first, min_second);
+}
+
+template <int Rows = 0, typename Weight, typename Count>
+void median_rows(const CountMinSketch<Weight, Count>& cms, const RowHasher& hasher,
+                 const size_t* hashes, size_t n, double* median, double* count_sum)
+{
+#if BDAP_HAVE_AVX2_KERNELS
+    if constexpr (std::is_same<Weight, double>::value && std::is_same<Count, double>::value) {
+        if (cpu_has_avx2() && cms.log_num_buckets() <= max_simd_log_num_buckets)
+            return median_rows_avx2<Rows>(cms, hasher, hashes, n, median, count_sum);
+    }
+#endif
+    median_rows_scalar<Rows>(cms, hasher, hashes, n, median, count_sum);
+}
+
+} // namespace kernels
+} // namespace bdap
@@ -0,0 +1,214 @@
+#pragma once
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include "mapped_file.hpp"
+#include "table.hpp"
+
+// Binary model snapshots. A snapshot is a fixed header followed by the raw
+// tables of the model, each starting on a page boundary, in the byte order of
+// the machine that wrote it:
+//
+//   [SnapshotHeader][pad][table 0][pad][table 1]...
+//
+// Loading maps the file read-only and points the model's tables straight at
+// the mapped pages, so there is no copy or parse step, startup time does not
+// depend on the table size, and processes that load the same file share its
+// pages. A loaded model copies a table into its own memory only when it is
+// updated.
+namespace bdap {
+
+constexpr uint32_t snapshot_version = 4;
+constexpr size_t snapshot_alignment = 4096;
+constexpr int max_snapshot_tables = 4;
+
+enum class SnapshotKind : uint32_t {
+    NaiveBayesFeatureHashing = 1,
+    NaiveBayesCountMin = 2,
+    PerceptronFeatureHashing = 3,
+    PerceptronCountMin = 4,
+};
+
+struct SnapshotTable {
+    uint64_t offset;    // from the start of the file
+    uint64_t size;      // number of elements
+    uint64_t elem_size; // sizeof one element, to catch a mismatching cell type
+};
+
+// every classifier stores the fields it has, the others stay 0
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t kind;
+    int32_t ngram;
+    int32_t num_hashes;
+    int32_t log_num_buckets;
+    int32_t seed;
+    int64_t num_spam;
+    int64_t num_ham;
+    int64_t total_spam;
+    int64_t total_ham;
+    double learning_rate;
+    double bias;
+    uint64_t decay_epoch; // set_decay of the naive bayes classifiers
+    double decay_factor;
+    uint64_t decay_cursor; // where the running decay goes on
+    double bias_sum; // set_averaged of the perceptrons, num_seen is 0 when not averaged
+    double num_seen;
+    uint32_t num_tables;
+    uint32_t cell_types; // cell_types_code() of the table cells
+    SnapshotTable tables[max_snapshot_tables];
+};
+
+inline const char* snapshot_magic() { return "BDAPSNAP"; }
+
+inline SnapshotHeader make_snapshot_header(SnapshotKind kind) {
+    SnapshotHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, snapshot_magic(), sizeof(header.magic));
+    header.version = snapshot_version;
+    header.kind = static_cast<uint32_t>(kind);
+    return header;
+}
+
+// Writes a snapshot: fill in the header fields, add the tables, then write.
+class SnapshotWriter {
+    SnapshotHeader header_;
+    const void* data_[max_snapshot_tables];
+
+public:
+    explicit SnapshotWriter(const SnapshotHeader& header) : header_(header) {}
+
+    SnapshotHeader& header() { return header_; }
+
+    template <typename T>
+    void add_table(const Table<T>& table) {
+        if (header_.num_tables == max_snapshot_tables)
+            throw std::logic_error("SnapshotWriter: too many tables");
+        SnapshotTable& t = header_.tables[header_.num_tables];
+        t.size = table.size();
+        t.elem_size = sizeof(T);
+        data_[header_.num_tables] = table.data();
+        ++header_.num_tables;
+    }
+
+    // Writes to path + ".tmp" and renames that over path once it is on disk. A
+    // process that has the old snapshot mapped keeps its pages (rewriting the file
+    // in place would truncate them under it and fault it with SIGBUS), and a crash
+    // never leaves a partly written snapshot at path.
+    void write(const std::string& path) {
+        uint64_t offset = align(sizeof(SnapshotHeader));
+        for (uint32_t i = 0; i < header_.num_tables; ++i) {
+            header_.tables[i].offset = offset;
+            offset = align(offset + header_.tables[i].size * header_.tables[i].elem_size);
+        }
+
+        std::string tmp = path + ".tmp";
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+            throw std::runtime_error("cannot open snapshot for writing: " + tmp);
+        bool ok = write_all(fd, &header_, sizeof(header_));
+        uint64_t pos = sizeof(header_);
+        for (uint32_t i = 0; i < header_.num_tables && ok; ++i) {
+            uint64_t bytes = header_.tables[i].size * header_.tables[i].elem_size;
+            ok = pad(fd, pos, header_.tables[i].offset) && write_all(fd, data_[i], bytes);
+            pos += bytes;
+        }
+        ok = ok && pad(fd, pos, offset) && ::fsync(fd) == 0;
+        ok = ::close(fd) == 0 && ok;
+        if (!ok || ::rename(tmp.c_str(), path.c_str()) != 0) {
+            ::unlink(tmp.c_str());
+            throw std::runtime_error("cannot write snapshot: " + path);
+        }
+        sync_directory(path);
+    }
+
+private:
+    static uint64_t align(uint64_t n) {
+        return (n + snapshot_alignment - 1) / snapshot_alignment * snapshot_alignment;
+    }
+
+    static bool write_all(int fd, const void* data, uint64_t size) {
+        const char* p = static_cast<const char*>(data);
+        while (size > 0) {
+            ssize_t w = ::write(fd, p, size);
+            if (w < 0 && errno == EINTR)
+                continue;
+            if (w <= 0)
+                return false;
+            p += w;
+            size -= static_cast<uint64_t>(w);
+        }
+        return true;
+    }
+
+    // zeros up to the next table, always less than snapshot_alignment
+    static bool pad(int fd, uint64_t& pos, uint64_t to) {
+        static const char zeros[snapshot_alignment] = {};
+        bool ok = write_all(fd, zeros, to - pos);
+        pos = to;
+        return ok;
+    }
+
+    // the rename reaches the disk with the directory; only best effort
+    static void sync_directory(const std::string& path) {
+        size_t slash = path.rfind('/');
+        std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+        int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0) {
+            ::fsync(fd);
+            ::close(fd);
+        }
+    }
+};
+
+// Maps a snapshot and checks its header; the tables it hands out borrow the
+// mapped memory and keep the mapping alive.
+class SnapshotReader {
+    std::shared_ptr<const MappedFile> file_;
+    const SnapshotHeader* header_;
+
+public:
+    SnapshotReader(const std::string& path, SnapshotKind kind, uint32_t cell_types)
+        : file_(std::make_shared<const MappedFile>(path))
+        , header_(reinterpret_cast<const SnapshotHeader*>(file_->data()))
+    {
+        if (file_->size() < sizeof(SnapshotHeader)
+                || std::memcmp(header_->magic, snapshot_magic(), sizeof(header_->magic)) != 0)
+            throw std::runtime_error("not a model snapshot: " + path);
+        if (header_->version != snapshot_version)
+            throw std::runtime_error("unsupported snapshot version: " + path);
+        if (header_->kind != static_cast<uint32_t>(kind))
+            throw std::runtime_error("snapshot holds a different classifier: " + path);
+        if (header_->cell_types != cell_types)
+            throw std::runtime_error("snapshot holds different cell types: " + path);
+        if (header_->num_tables > max_snapshot_tables)
+            throw std::runtime_error("corrupt snapshot: " + path);
+        for (uint32_t i = 0; i < header_->num_tables; ++i) {
+            const SnapshotTable& t = header_->tables[i];
+            // in this order, so that a corrupt size cannot overflow the check
+            if (t.offset % snapshot_alignment != 0 || t.elem_size == 0 || t.offset > file_->size()
+                    || t.size > (file_->size() - t.offset) / t.elem_size)
+                throw std::runtime_error("corrupt snapshot: " + path);
+        }
+    }
+
+    const SnapshotHeader& header() const { return *header_; }
+
+    template <typename T>
+    Table<T> table(uint32_t i) const {
+        if (i >= header_->num_tables || header_->tables[i].elem_size != sizeof(T))
+            throw std::runtime_error("snapshot table does not match the classifier");
+        const SnapshotTable& t = header_->tables[i];
+        return Table<T>(reinterpret_cast<const T*>(file_->data() + t.offset), t.size, file_);
+    }
+};
+
+} // namespace bdap
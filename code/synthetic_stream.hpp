@@ -0,0 +1,81 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <random>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "email_view.hpp"
+
+// Synthetic email streams for the benchmarks: words are drawn from a Zipf
+// distribution over a random vocabulary, and with probability signal from a
+// second Zipf distribution that differs between spam and ham (and between
+// campaigns), so the stream is learnable but not trivially. The same rng seed
+// gives the same stream.
+namespace bdap {
+
+// a stream of synthetic emails; the views point into text
+struct Stream {
+    std::string text;
+    std::vector<EmailView> emails;
+};
+
+class StreamGenerator {
+    std::vector<std::string> words_;
+    std::vector<double> zipf_; // cumulative
+    double signal_;
+
+public:
+    StreamGenerator(size_t vocab, double signal, std::mt19937_64& rng) : signal_(signal) {
+        std::uniform_int_distribution<int> len(3, 10);
+        std::uniform_int_distribution<int> letter('a', 'z');
+        words_.resize(std::max<size_t>(vocab, 1));
+        for (std::string& w : words_)
+            for (int i = len(rng); i > 0; --i)
+                w.push_back(static_cast<char>(letter(rng)));
+        double sum = 0.0;
+        for (size_t r = 0; r < words_.size(); ++r)
+            zipf_.push_back(sum += 1.0 / (r + 1));
+        for (double& z : zipf_)
+            z /= sum;
+    }
+
+    // email i belongs to campaign first_campaign + i / drift (always first_campaign
+    // for drift 0), every campaign has other class words
+    Stream generate(size_t n, size_t length, size_t repeat, size_t drift, size_t first_campaign,
+                    std::mt19937_64& rng) const {
+        Stream s;
+        s.text.reserve(n * (length + 16));
+        std::vector<std::pair<bool, std::pair<size_t, size_t>>> spans;
+        std::bernoulli_distribution coin(0.5);
+        std::bernoulli_distribution class_word(signal_);
+        std::uniform_real_distribution<double> u(0.0, 1.0);
+        repeat = std::max<size_t>(repeat, 1);
+        for (size_t i = 0; i < n; ++i) {
+            bool spam = coin(rng);
+            size_t campaign = first_campaign + (drift != 0 ? i / drift : 0);
+            size_t begin = s.text.size();
+            while (s.text.size() - begin < length / repeat) {
+                size_t r = std::lower_bound(zipf_.begin(), zipf_.end(), u(rng)) - zipf_.begin();
+                r = std::min(r, words_.size() - 1);
+                // class words: the spam and ham ranks are shifted apart
+                if (class_word(rng))
+                    r = (r * 2 + (spam ? 1 : 0) + words_.size() / 2 + campaign * (words_.size() / 3))
+                        % words_.size();
+                s.text += words_[r];
+                s.text += ' ';
+            }
+            size_t block = s.text.size() - begin;
+            for (size_t k = 1; k < repeat; ++k)
+                s.text.append(s.text, begin, block);
+            spans.push_back({spam, {begin, s.text.size() - begin}});
+        }
+        for (const auto& sp : spans)
+            s.emails.emplace_back(sp.first, std::string_view(s.text).substr(sp.second.first, sp.second.second));
+        return s;
+    }
+};
+
+} // namespace bdap
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <vector>
+#include "table_memory.hpp"
+
+namespace bdap {
+
+// Fixed-size array behind the classifier tables. It either owns its
+// (cache-aligned) memory, or borrows read-only memory such as a mapped model
+// snapshot. A borrowed table is copied into owned memory on the first write,
+// so a mapped model can be served as is and still be trained further. Owned
+// memory is placed as its TableMemory says, see table_memory.hpp.
+template <typename T>
+class Table {
+    std::vector<T, TableAllocator<T>> owned_;
+    T* data_ = nullptr;
+    size_t size_ = 0;
+    std::shared_ptr<const void> mapping_; // keeps borrowed memory alive, empty when owned
+
+public:
+    Table() = default;
+
+    Table(size_t n, const T& value, const TableMemory& memory = TableMemory())
+        : owned_(n, value, TableAllocator<T>(memory))
+        , data_(owned_.data())
+        , size_(n)
+    {}
+
+    // borrow n elements at data, which stay valid as long as mapping is alive
+    Table(const T* data, size_t n, std::shared_ptr<const void> mapping)
+        : data_(const_cast<T*>(data))
+        , size_(n)
+        , mapping_(std::move(mapping))
+    {}
+
+    Table(const Table& other)
+        : owned_(other.owned_)
+        , data_(other.mapping_ ? other.data_ : owned_.data())
+        , size_(other.size_)
+        , mapping_(other.mapping_)
+    {}
+
+    Table(Table&& other) noexcept
+        : owned_(std::move(other.owned_))
+        , data_(other.mapping_ ? other.data_ : owned_.data())
+        , size_(other.size_)
+        , mapping_(std::move(other.mapping_))
+    {
+        other.data_ = nullptr;
+        other.size_ = 0;
+    }
+
+    // copying into an owned table of the same size reuses its memory
+    Table& operator=(const Table& other) {
+        if (this == &other)
+            return *this;
+        if (other.mapping_) {
+            owned_ = decltype(owned_)(other.owned_.get_allocator());
+            data_ = other.data_;
+        } else {
+            owned_ = other.owned_;
+            data_ = owned_.data();
+        }
+        size_ = other.size_;
+        mapping_ = other.mapping_;
+        return *this;
+    }
+
+    Table& operator=(Table&& other) noexcept {
+        owned_ = std::move(other.owned_);
+        data_ = other.mapping_ ? other.data_ : owned_.data();
+        size_ = other.size_;
+        mapping_ = std::move(other.mapping_);
+        other.data_ = nullptr;
+        other.size_ = 0;
+        return *this;
+    }
+
+    size_t size() const { return size_; }
+    bool is_borrowed() const { return static_cast<bool>(mapping_); }
+
+    const T* data() const { return data_; }
+    T* data() {
+        if (mapping_)
+            make_owned();
+        return data_;
+    }
+
+    const T& operator[](size_t i) const { return data_[i]; }
+    T& operator[](size_t i) {
+        if (mapping_)
+            make_owned();
+        return data_[i];
+    }
+
+    void fill(const T& value) { std::fill(data(), data() + size_, value); }
+
+    TableMemory memory() const { return owned_.get_allocator().memory(); }
+
+    // move an owned table into memory placed as asked; a borrowed table stays
+    // borrowed and gets that memory when it is first written
+    void set_memory(const TableMemory& memory) {
+        if (memory == this->memory())
+            return;
+        decltype(owned_) moved(owned_.begin(), owned_.end(), TableAllocator<T>(memory));
+        owned_ = std::move(moved);
+        if (!mapping_)
+            data_ = owned_.data();
+    }
+
+private:
+    void make_owned() {
+        owned_.assign(data_, data_ + size_);
+        data_ = owned_.data();
+        mapping_.reset();
+    }
+};
+
+} // namespace bdap
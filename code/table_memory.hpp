@@ -0,0 +1,204 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+#include <new>
+#include <type_traits>
+#include <sys/mman.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+// Where the memory of the classifier tables comes from. By default a table is
+// an ordinary cache-aligned heap allocation. Tables of a few hundred MB
+// (log_num_buckets 22 and up) are read at random, so almost every lookup also
+// misses the TLB, and on a machine with several NUMA nodes they end up on
+// whichever node first wrote them. TableMemory asks for huge pages and for a
+// NUMA placement instead; such tables are mapped with mmap. Everything here is
+// a hint: when the kernel has no huge pages or no NUMA support the table
+// silently gets ordinary pages, so the same binary runs everywhere.
+namespace bdap {
+
+enum class TablePages {
+    Default,     // whatever the heap gives
+    Transparent, // 2 MB aligned mapping with madvise(MADV_HUGEPAGE), needs THP enabled or "madvise"
+    Explicit,    // MAP_HUGETLB from the reserved pool (vm.nr_hugepages), else Transparent
+};
+
+enum class TableNuma {
+    Default,    // first touch, the node of the thread that fills the table
+    Local,      // preferably on node, or on the node of the allocating thread for node -1
+    Interleave, // pages spread round robin over all allowed nodes
+};
+
+struct TableMemory {
+    TablePages pages = TablePages::Default;
+    TableNuma numa = TableNuma::Default;
+    int node = -1; // for TableNuma::Local
+
+    bool is_default() const { return pages == TablePages::Default && numa == TableNuma::Default; }
+
+    bool operator==(const TableMemory& other) const {
+        return pages == other.pages && numa == other.numa && node == other.node;
+    }
+    bool operator!=(const TableMemory& other) const { return !(*this == other); }
+};
+
+namespace detail {
+
+// smaller tables stay on the heap whatever they ask for
+constexpr size_t min_mapped_table_bytes = 1 << 16;
+
+// the default huge page size, from /proc/meminfo
+inline size_t huge_page_bytes() {
+    static const size_t bytes = [] {
+        size_t kb = 2048;
+        if (FILE* f = std::fopen("/proc/meminfo", "r")) {
+            char line[256];
+            while (std::fgets(line, sizeof(line), f))
+                if (std::sscanf(line, "Hugepagesize: %zu kB", &kb) == 1)
+                    break;
+            std::fclose(f);
+        }
+        return kb * 1024;
+    }();
+    return bytes;
+}
+
+inline size_t round_up(size_t n, size_t multiple) { return (n + multiple - 1) / multiple * multiple; }
+
+// the length of the mapping behind a mapped table of n bytes
+inline size_t mapped_table_bytes(size_t n, const TableMemory& memory) {
+    size_t page = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    return round_up(n, memory.pages == TablePages::Default ? page : huge_page_bytes());
+}
+
+// mbind the (not yet touched) mapping; without NUMA support the call fails and
+// the pages are placed by first touch as usual
+inline void place_table(void* p, size_t len, const TableMemory& memory) {
+#if defined(__linux__) && defined(SYS_mbind)
+    constexpr int mpol_preferred = 1; // from <numaif.h>, which needs libnuma
+    constexpr int mpol_interleave = 3;
+    constexpr unsigned long mpol_f_mems_allowed = 1 << 2;
+    constexpr unsigned long max_nodes = 1024;
+    unsigned long mask[max_nodes / (8 * sizeof(unsigned long))] = {};
+
+    if (memory.numa == TableNuma::Local) {
+        unsigned node = static_cast<unsigned>(memory.node);
+        if (memory.node < 0) {
+            unsigned cpu;
+            if (::syscall(SYS_getcpu, &cpu, &node, nullptr) != 0)
+                return;
+        }
+        if (node >= max_nodes)
+            return;
+        mask[node / (8 * sizeof(unsigned long))] |= 1ul << (node % (8 * sizeof(unsigned long)));
+        ::syscall(SYS_mbind, p, len, mpol_preferred, mask, max_nodes + 1, 0);
+    } else if (memory.numa == TableNuma::Interleave) {
+        if (::syscall(SYS_get_mempolicy, nullptr, mask, max_nodes, nullptr, mpol_f_mems_allowed) != 0)
+            return;
+        ::syscall(SYS_mbind, p, len, mpol_interleave, mask, max_nodes + 1, 0);
+    }
+#else
+    (void)p;
+    (void)len;
+    (void)memory;
+#endif
+}
+
+// anonymous mapping of len bytes aligned to align, nullptr if mmap fails
+inline void* map_aligned(size_t len, size_t align) {
+    void* p = ::mmap(nullptr, len + align, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return nullptr;
+    char* begin = static_cast<char*>(p);
+    char* aligned = reinterpret_cast<char*>(round_up(reinterpret_cast<size_t>(begin), align));
+    if (aligned != begin)
+        ::munmap(begin, aligned - begin);
+    if (aligned + len != begin + len + align)
+        ::munmap(aligned + len, begin + len + align - (aligned + len));
+    return aligned;
+}
+
+inline void* allocate_mapped_table(size_t n, const TableMemory& memory) {
+    size_t len = mapped_table_bytes(n, memory);
+    void* p = nullptr;
+#if defined(MAP_HUGETLB)
+    if (memory.pages == TablePages::Explicit) {
+        p = ::mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p == MAP_FAILED)
+            p = nullptr;
+    }
+#endif
+    if (!p && memory.pages != TablePages::Default) {
+        p = map_aligned(len, huge_page_bytes());
+#if defined(MADV_HUGEPAGE)
+        if (p)
+            ::madvise(p, len, MADV_HUGEPAGE);
+#endif
+    } else if (!p) {
+        p = ::mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            p = nullptr;
+    }
+    if (!p)
+        throw std::bad_alloc();
+    place_table(p, len, memory);
+    return p;
+}
+
+} // namespace detail
+
+// Allocator of the owned memory of a Table: cache-line aligned heap memory, or
+// a mapping as asked for by its TableMemory. The memory travels with the
+// allocator, so copies and moves of a table keep their placement.
+template <typename T, size_t Align = 64>
+class TableAllocator {
+    TableMemory memory_;
+
+    template <typename U, size_t A>
+    friend class TableAllocator;
+
+public:
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    template <typename U>
+    struct rebind { using other = TableAllocator<U, Align>; };
+
+    TableAllocator() = default;
+    explicit TableAllocator(const TableMemory& memory) : memory_(memory) {}
+
+    template <typename U>
+    TableAllocator(const TableAllocator<U, Align>& other) : memory_(other.memory_) {}
+
+    const TableMemory& memory() const { return memory_; }
+
+    T* allocate(size_t n) {
+        if (mapped(n))
+            return static_cast<T*>(detail::allocate_mapped_table(n * sizeof(T), memory_));
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Align)));
+    }
+
+    void deallocate(T* p, size_t n) {
+        if (mapped(n))
+            ::munmap(p, detail::mapped_table_bytes(n * sizeof(T), memory_));
+        else
+            ::operator delete(p, std::align_val_t(Align));
+    }
+
+    template <typename U>
+    bool operator==(const TableAllocator<U, Align>& other) const { return memory_ == other.memory_; }
+    template <typename U>
+    bool operator!=(const TableAllocator<U, Align>& other) const { return memory_ != other.memory_; }
+
+private:
+    bool mapped(size_t n) const {
+        return !memory_.is_default() && n * sizeof(T) >= detail::min_mapped_table_bytes;
+    }
+};
+
+} // namespace bdap
@@ -0,0 +1,93 @@
+// Once the scratch buffers have grown to the longest email, update and predict
+// must not allocate: every operator new of the process is counted, and a
+// second pass over the same emails has to leave the count unchanged.
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <vector>
+#include "check.hpp"
+#include "email_view.hpp"
+#include "naive_bayes_count_min.hpp"
+#include "naive_bayes_feature_hashing.hpp"
+#include "perceptron_count_min.hpp"
+#include "perceptron_feature_hashing.hpp"
+
+namespace {
+
+std::atomic<long long> allocations{0};
+
+void* allocate(std::size_t size, std::size_t alignment) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (size == 0)
+        size = 1;
+    void* p = alignment <= alignof(std::max_align_t)
+        ? std::malloc(size)
+        : std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+
+} // namespace
+
+void* operator new(std::size_t size) { return allocate(size, 0); }
+void* operator new[](std::size_t size) { return allocate(size, 0); }
+void* operator new(std::size_t size, std::align_val_t a) { return allocate(size, static_cast<std::size_t>(a)); }
+void* operator new[](std::size_t size, std::align_val_t a) { return allocate(size, static_cast<std::size_t>(a)); }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+
+using namespace bdap;
+
+namespace {
+
+volatile double scores; // keeps the passes from being optimized away
+
+// prequential passes over emails, through both the Email and the EmailView API
+template <typename Clf>
+double pass(Clf& clf, const std::vector<Email>& emails) {
+    double sum = 0.0;
+    for (const Email& email : emails) {
+        sum += clf.predict(email);
+        clf.update(email);
+        EmailView view(email.is_spam(), email.body());
+        sum += clf.predict(view);
+        clf.update(view);
+    }
+    return sum;
+}
+
+template <typename Clf>
+void check_no_allocations(Clf clf, const std::vector<Email>& emails) {
+    for (bool dedup : {false, true}) {
+        clf.set_dedup(dedup);
+        pass(clf, emails); // warm-up: the scratch buffers grow
+        long long before = allocations.load();
+        scores = pass(clf, emails);
+        CHECK(allocations.load() == before);
+    }
+}
+
+} // namespace
+
+int main() {
+    std::vector<Email> emails = synthetic_emails(200, 2000, 1);
+    check_no_allocations(NaiveBayesFeatureHashing(3, 14), emails);
+    check_no_allocations(NaiveBayesCountMin(3, 4, 14), emails);
+    check_no_allocations(PerceptronFeatureHashing(3, 14, 0.01), emails);
+    check_no_allocations(PerceptronCountMin(3, 4, 14, 0.01), emails);
+
+    // the counter works
+    long long before = allocations.load();
+    std::vector<int>* v = new std::vector<int>(10);
+    delete v;
+    CHECK(allocations.load() == before + 2);
+    return 0;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+#include "email.hpp"
+#include "synthetic_stream.hpp"
+
+// The tests are plain executables run by ctest (see CMakeLists.txt) that exit
+// non-zero on the first failed CHECK. Unlike assert, CHECK also runs in release
+// builds, which are the ones the tests are meant for.
+#define CHECK(cond)                                                                   \
+    do {                                                                              \
+        if (!(cond)) {                                                                \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            std::exit(1);                                                             \
+        }                                                                             \
+    } while (0)
+
+namespace bdap {
+
+// n learnable emails of about length bytes, the same for the same seed
+inline std::vector<Email> synthetic_emails(size_t n, size_t length, unsigned seed) {
+    std::mt19937_64 rng(seed);
+    StreamGenerator generator(2000, 0.1, rng);
+    Stream stream = generator.generate(n, length, 1, 0, 0, rng);
+    std::vector<Email> emails;
+    emails.reserve(n);
+    for (const EmailView& email : stream.emails)
+        emails.emplace_back(email.is_spam(), std::string(email.body()));
+    return emails;
+}
+
+} // namespace bdap
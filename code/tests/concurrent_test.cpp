@@ -0,0 +1,91 @@
+// Stress test of SnapshotClf: reader threads score while one writer trains and
+// publishes. Every score a reader sees must be the score of some published
+// model, bit for bit, so a reader never scores a snapshot being overwritten.
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <thread>
+#include <vector>
+#include "check.hpp"
+#include "concurrent.hpp"
+#include "naive_bayes_feature_hashing.hpp"
+#include "perceptron_feature_hashing.hpp"
+
+using namespace bdap;
+
+namespace {
+
+const int num_readers = 3;
+const size_t publish_every = 7;
+
+// model has seen both classes, so that every score is finite and they sort
+template <typename Clf>
+void stress(const Clf& model, const std::vector<Email>& train, const Email& probe) {
+    // the scores of probe under every model the writer can publish
+    std::vector<double> published;
+    Clf serial = model;
+    published.push_back(serial.predict(probe));
+    for (size_t i = 0; i < train.size(); ++i) {
+        serial.update(train[i]);
+        if ((i + 1) % publish_every == 0 || i + 1 == train.size())
+            published.push_back(serial.predict(probe));
+    }
+    for (double score : published)
+        CHECK(std::isfinite(score));
+    std::sort(published.begin(), published.end());
+
+    SnapshotClf<Clf> clf(model, publish_every);
+    std::atomic<bool> done{false};
+    std::atomic<long long> reads{0};
+    std::atomic<long long> bad_scores{0};
+    std::atomic<long long> bad_classes{0};
+
+    std::vector<std::thread> readers;
+    for (int r = 0; r < num_readers; ++r) {
+        readers.emplace_back([&] {
+            long long n = 0;
+            // at least one read after the last publish
+            for (bool last = false; !last; ++n) {
+                last = done.load();
+                double score = clf.predict(probe);
+                if (!std::binary_search(published.begin(), published.end(), score))
+                    bad_scores.fetch_add(1);
+                if (clf.classify(score) != model.classify(score))
+                    bad_classes.fetch_add(1);
+            }
+            reads.fetch_add(n);
+        });
+    }
+
+    for (const Email& email : train)
+        clf.update(email);
+    clf.publish();
+    done.store(true);
+    for (std::thread& t : readers)
+        t.join();
+
+    CHECK(bad_scores.load() == 0);
+    CHECK(bad_classes.load() == 0);
+    CHECK(reads.load() >= num_readers);
+    // the readers end on the fully trained model
+    CHECK(clf.predict(probe) == serial.predict(probe));
+}
+
+template <typename Clf>
+Clf warmed_up(Clf clf, const std::vector<Email>& emails) {
+    for (const Email& email : emails)
+        clf.update(email);
+    return clf;
+}
+
+} // namespace
+
+int main() {
+    std::vector<Email> warm_up = synthetic_emails(100, 300, 1);
+    std::vector<Email> train = synthetic_emails(1500, 300, 2);
+    Email probe = synthetic_emails(1, 300, 3)[0];
+    stress(warmed_up(NaiveBayesFeatureHashing(3, 12), warm_up), train, probe);
+    stress(warmed_up(PerceptronFeatureHashing(3, 12, 0.01), warm_up), train, probe);
+    return 0;
+}
@@ -0,0 +1,132 @@
+// ScoringEngine and ScoringServer: the engine scores like predict, a callback
+// that throws neither ends its worker nor loses the rest of the batch, the
+// server answers a pipelined connection in order, the threads of closed
+// connections go away, and the server shuts down with a connection still open.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "check.hpp"
+#include "naive_bayes_feature_hashing.hpp"
+#include "scoring_engine.hpp"
+#include "scoring_server.hpp"
+
+using namespace bdap;
+
+namespace {
+
+int connect_unix(const std::string& path) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    CHECK(fd >= 0);
+    CHECK(::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+    return fd;
+}
+
+// reads until n lines have arrived
+std::vector<std::string> read_lines(int fd, size_t n) {
+    std::vector<std::string> lines;
+    std::string in;
+    char buf[4096];
+    while (lines.size() < n) {
+        ssize_t r = ::read(fd, buf, sizeof(buf));
+        CHECK(r > 0);
+        in.append(buf, static_cast<size_t>(r));
+        size_t end;
+        while ((end = in.find('\n')) != std::string::npos) {
+            lines.push_back(in.substr(0, end));
+            in.erase(0, end + 1);
+        }
+    }
+    return lines;
+}
+
+template <typename Pred>
+bool eventually(Pred pred) {
+    for (int i = 0; i < 500; ++i) {
+        if (pred())
+            return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return false;
+}
+
+} // namespace
+
+int main() {
+    std::vector<Email> train = synthetic_emails(300, 300, 1);
+    std::vector<Email> test = synthetic_emails(100, 300, 2);
+    NaiveBayesFeatureHashing clf(3, 14);
+    for (const Email& email : train)
+        clf.update(email);
+
+    ScoringEngineConfig config;
+    config.num_workers = 2;
+    config.max_batch = 8;
+    config.pin_workers = false;
+    ScoringEngine<NaiveBayesFeatureHashing> engine(clf, config);
+
+    std::vector<std::future<double>> scores;
+    for (const Email& email : test)
+        scores.push_back(engine.submit(std::string(email.body())));
+    for (size_t i = 0; i < test.size(); ++i)
+        CHECK(scores[i].get() == clf.predict(test[i]));
+
+    // the emails batched with a throwing callback still get their scores
+    std::vector<std::future<double>> after;
+    engine.submit(std::string(test[0].body()), [](double) { throw std::runtime_error("callback"); });
+    for (size_t i = 1; i < 10; ++i)
+        after.push_back(engine.submit(std::string(test[i].body())));
+    for (size_t i = 1; i < 10; ++i)
+        CHECK(after[i - 1].get() == clf.predict(test[i]));
+    CHECK(engine.callback_errors() == 1);
+
+    char dir[] = "/tmp/bdap_scoring_test.XXXXXX";
+    CHECK(::mkdtemp(dir) != nullptr);
+    std::string path = std::string(dir) + "/scoring.sock";
+    int open_fd = -1;
+    {
+        ScoringServer<NaiveBayesFeatureHashing> server(engine, path);
+
+        // three emails in one write, three answers in order
+        int fd = connect_unix(path);
+        std::string request;
+        for (size_t i = 0; i < 3; ++i)
+            request += std::string(test[i].body()) + "\n";
+        CHECK(::send(fd, request.data(), request.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(request.size()));
+        std::vector<std::string> lines = read_lines(fd, 3);
+        for (size_t i = 0; i < 3; ++i) {
+            double score = clf.predict(test[i]);
+            char expected[64];
+            std::snprintf(expected, sizeof(expected), "%.9g %d", score, clf.classify(score) ? 1 : 0);
+            CHECK(lines[i] == expected);
+        }
+        ::close(fd);
+
+        // closed connections do not leave their threads behind
+        for (int i = 0; i < 50; ++i)
+            ::close(connect_unix(path));
+        CHECK(eventually([&] { return server.num_connections() == 0; }));
+
+        // the destructor closes a connection the client keeps open
+        open_fd = connect_unix(path);
+        CHECK(eventually([&] { return server.num_connections() == 1; }));
+    }
+    char byte;
+    CHECK(::read(open_fd, &byte, 1) == 0);
+    ::close(open_fd);
+    CHECK(::access(path.c_str(), F_OK) != 0);
+    ::rmdir(dir);
+    return 0;
+}
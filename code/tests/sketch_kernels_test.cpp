@@ -0,0 +1,88 @@
+// The dispatched Count-Min kernels (AVX2 where the CPU has it) must give
+// exactly the results of the scalar ones, and counts out of the range of int
+// must saturate instead of wrapping.
+
+#include <climits>
+#include <random>
+#include <vector>
+#include "check.hpp"
+#include "sketch_kernels.hpp"
+
+using namespace bdap;
+
+namespace {
+
+std::vector<size_t> random_hashes(size_t n, std::mt19937_64& rng) {
+    std::vector<size_t> hashes(n);
+    for (size_t& h : hashes)
+        h = static_cast<size_t>(rng());
+    return hashes;
+}
+
+void check_median_rows(int k, std::mt19937_64& rng) {
+    CountMinSketch<double> cms(k, 8);
+    std::uniform_real_distribution<double> weight(-1e12, 1e12);
+    std::uniform_int_distribution<int> count(0, 1000);
+    for (size_t c = 0; c < cms.size(); ++c)
+        cms.data()[c] = {weight(rng), static_cast<double>(count(rng))};
+    RowHasher hasher(7, 8);
+    std::vector<size_t> hashes = random_hashes(kernels::block_size - 3, rng);
+
+    size_t n = hashes.size();
+    std::vector<double> median(n), count_sum(n), median_scalar(n), count_sum_scalar(n);
+    kernels::median_rows(cms, hasher, hashes.data(), n, median.data(), count_sum.data());
+    kernels::median_rows_scalar(cms, hasher, hashes.data(), n, median_scalar.data(), count_sum_scalar.data());
+    for (size_t j = 0; j < n; ++j) {
+        CHECK(median[j] == median_scalar[j]);
+        CHECK(count_sum[j] == count_sum_scalar[j]);
+    }
+}
+
+void check_min_rows(int k, std::mt19937_64& rng) {
+    CountMinSketch<int> cms(k, 8);
+    std::uniform_int_distribution<int> count(INT_MIN, INT_MAX);
+    for (size_t c = 0; c < cms.size(); ++c)
+        cms.data()[c] = {count(rng), count(rng)};
+    RowHasher hasher(7, 8);
+    std::vector<size_t> hashes = random_hashes(kernels::block_size - 3, rng);
+
+    size_t n = hashes.size();
+    std::vector<int> a(n), b(n), a_scalar(n), b_scalar(n);
+    kernels::min_rows(cms, hasher, hashes.data(), n, a.data(), b.data());
+    kernels::min_rows_scalar(cms, hasher, hashes.data(), n, a_scalar.data(), b_scalar.data());
+    CHECK(a == a_scalar);
+    CHECK(b == b_scalar);
+}
+
+} // namespace
+
+int main() {
+    std::mt19937_64 rng(1);
+    for (int k = 1; k <= kernels::max_simd_median_rows + 2; ++k) {
+        check_median_rows(k, rng);
+        check_min_rows(k, rng);
+    }
+    // the same with the rows known at compile time
+    CountMinSketch<double> cms4(4, 8);
+    RowHasher hasher(7, 8);
+    std::vector<size_t> hashes = random_hashes(9, rng);
+    std::vector<double> median(9), count_sum(9), median_rt(9), count_sum_rt(9);
+    for (size_t c = 0; c < cms4.size(); ++c)
+        cms4.data()[c] = {static_cast<double>(c % 13) - 6.5, 1.0};
+    kernels::median_rows<4>(cms4, hasher, hashes.data(), 9, median.data(), count_sum.data());
+    kernels::median_rows(cms4, hasher, hashes.data(), 9, median_rt.data(), count_sum_rt.data());
+    CHECK(median == median_rt);
+    CHECK(count_sum == count_sum_rt);
+    CHECK(count_sum[0] == 4.0);
+
+    // float counts beyond int saturate
+    CountMinSketch<float> big(2, 4);
+    for (size_t c = 0; c < big.size(); ++c)
+        big.data()[c] = {3e12f, -3e12f};
+    int a = 0, b = 0;
+    size_t h = 12345;
+    kernels::min_rows(big, RowHasher(7, 4), &h, 1, &a, &b);
+    CHECK(a == INT_MAX);
+    CHECK(b == INT_MIN);
+    return 0;
+}
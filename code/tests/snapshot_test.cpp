@@ -0,0 +1,125 @@
+// Snapshots: a saved model loads with the same scores, saving over a snapshot
+// that is still mapped leaves the mapped model intact, a model saved halfway
+// through a decay sweep goes on decaying like the original after load, a
+// perceptron (also an averaged one) trains on after load like the original,
+// and a corrupt table size is rejected instead of overflowing the bounds check.
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "check.hpp"
+#include "naive_bayes_count_min.hpp"
+#include "naive_bayes_feature_hashing.hpp"
+#include "perceptron_count_min.hpp"
+#include "perceptron_feature_hashing.hpp"
+
+using namespace bdap;
+
+namespace {
+
+template <typename Clf>
+std::vector<double> scores(const Clf& clf, const std::vector<Email>& emails) {
+    std::vector<double> s;
+    for (const Email& email : emails)
+        s.push_back(clf.predict(email));
+    return s;
+}
+
+bool exists(const std::string& path) { return ::access(path.c_str(), F_OK) == 0; }
+
+// saves clf in the middle of an epoch, then trains it and the loaded copy alike
+template <typename Clf>
+void check_decay_survives(Clf clf, const std::string& path, const std::vector<Email>& train,
+                          const std::vector<Email>& test) {
+    clf.set_decay(7, 0.5);
+    for (size_t i = 0; i < 100; ++i)
+        clf.update(train[i]);
+    clf.save(path);
+    Clf loaded = Clf::load(path);
+    for (size_t i = 100; i < 200; ++i) {
+        clf.update(train[i]);
+        loaded.update(train[i]);
+    }
+    CHECK(scores(loaded, test) == scores(clf, test));
+    std::remove(path.c_str());
+}
+
+// saves a perceptron halfway through training, then trains it and the loaded copy alike
+template <typename Clf>
+void check_training_survives(Clf clf, bool averaged, const std::string& path,
+                             const std::vector<Email>& train, const std::vector<Email>& test) {
+    clf.set_averaged(averaged);
+    for (size_t i = 0; i < 100; ++i)
+        clf.update(train[i]);
+    clf.save(path);
+    Clf loaded = Clf::load(path);
+    CHECK(scores(loaded, test) == scores(clf, test));
+    for (size_t i = 100; i < 200; ++i) {
+        clf.update(train[i]);
+        loaded.update(train[i]);
+    }
+    CHECK(scores(loaded, test) == scores(clf, test));
+    std::remove(path.c_str());
+}
+
+} // namespace
+
+int main() {
+    char dir[] = "/tmp/bdap_snapshot_test.XXXXXX";
+    CHECK(::mkdtemp(dir) != nullptr);
+    std::string path = std::string(dir) + "/model.snap";
+
+    std::vector<Email> train = synthetic_emails(400, 300, 1);
+    std::vector<Email> test = synthetic_emails(50, 300, 2);
+    NaiveBayesCountMin clf(3, 4, 12);
+    for (size_t i = 0; i < train.size() / 2; ++i)
+        clf.update(train[i]);
+    clf.save(path);
+    CHECK(!exists(path + ".tmp"));
+
+    NaiveBayesCountMin loaded = NaiveBayesCountMin::load(path);
+    std::vector<double> expected = scores(clf, test);
+    CHECK(scores(loaded, test) == expected);
+
+    // replace the snapshot while loaded still scores from its pages
+    for (size_t i = train.size() / 2; i < train.size(); ++i)
+        clf.update(train[i]);
+    clf.save(path);
+    CHECK(scores(loaded, test) == expected);
+    CHECK(scores(NaiveBayesCountMin::load(path), test) == scores(clf, test));
+
+    check_decay_survives(NaiveBayesCountMin(3, 4, 12), std::string(dir) + "/decay.snap", train, test);
+    check_decay_survives(NaiveBayesFeatureHashing(3, 12), std::string(dir) + "/decay.snap", train, test);
+
+    for (bool averaged : {false, true}) {
+        check_training_survives(PerceptronFeatureHashing(3, 12, 0.1), averaged,
+                                std::string(dir) + "/perceptron.snap", train, test);
+        check_training_survives(PerceptronCountMin(3, 4, 12, 0.1), averaged,
+                                std::string(dir) + "/perceptron.snap", train, test);
+    }
+
+    // a table size that makes offset + size * elem_size wrap around
+    {
+        std::fstream f(path, std::ios::in | std::ios::out | std::ios::binary);
+        SnapshotHeader header;
+        f.read(reinterpret_cast<char*>(&header), sizeof(header));
+        header.tables[0].size = ~uint64_t(0) / header.tables[0].elem_size;
+        f.seekp(0);
+        f.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    }
+    bool rejected = false;
+    try {
+        NaiveBayesCountMin::load(path);
+    } catch (const std::runtime_error&) {
+        rejected = true;
+    }
+    CHECK(rejected);
+
+    std::remove(path.c_str());
+    ::rmdir(dir);
+    return 0;
+}